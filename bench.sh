@@ -0,0 +1,245 @@
+#!/bin/sh
+#
+# Compares the bucket layouts: builds the headless simulation once for
+# every bucket size, and times 1000 generations of a sparse and a dense
+# pattern with each.
+#
+# With numa, times a large dense pattern with 1, 2, 4 and so on up to
+# every CPU as workers instead, with and without -N, to show how the
+# steps scale across sockets.
+#
+# With layout, times both patterns with and without laying the quadtree
+# out again every 100 generations, along with the cache misses perf stat
+# counts when perf is installed.
+#
+# With lookup, times get() on grids of buckets spaced further and
+# further apart, through the index of the tree and through the quads.
+#
+# With check, times nothing: jumps a soup to the same generation with
+# every engine, bucket size, several workers, the memo and processes,
+# and through a checkpoint, and fails unless they all write the same
+# cells as stepping one generation at a time.
+#
+# Usage: ./bench.sh [workers]
+#        ./bench.sh numa
+#        ./bench.sh layout [workers]
+#        ./bench.sh lookup
+#        ./bench.sh check
+
+set -e
+
+MODE=sizes
+if [ "$1" = numa ] || [ "$1" = layout ] || [ "$1" = lookup ] \
+ || [ "$1" = check ]; then
+	MODE=$1
+	shift
+fi
+WORKERS=${1:-1}
+CC=${CC:-cc}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+SOURCES="src/arena.c src/checkpoint.c src/conway.c src/domain.c
+         src/hashlife.c src/kernel.c src/load.c src/memo.c src/topology.c
+         src/work_queue.c src/main.c"
+
+# soup W H SEED: random W by H RLE with 35% of the cells alive,
+# as blocks of soup spaced 512 cells apart when SPACED is set.
+soup() {
+	awk -v w="$1" -v h="$2" -v seed="$3" -v spaced="$SPACED" 'BEGIN {
+		srand(seed);
+		printf("x = %d, y = %d\n", w, h);
+		for(y = 0; y < h; ++y) {
+			line = "";
+			gap = 0;
+			for(x = 0; x < w; ++x) {
+				live = rand() < 0.35;
+				if (spaced && (x % 512 >= 24 || y % 512 >= 24))
+					live = 0;
+				if (!live) {
+					gap++;
+					continue;
+				}
+				if (gap)
+					line = line gap "b";
+				line = line "o";
+				gap = 0;
+			}
+			print line "$";
+		}
+		print "!";
+	}'
+}
+
+# elapsed COMMAND...: runs COMMAND, printing the seconds it took.
+elapsed() {
+	start=$(date +%s.%N)
+	"$@"
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { printf("%.2f", e - s) }'
+}
+
+if [ $MODE = numa ]; then
+	SPACED= soup 2048 2048 3 > "$DIR/large.rle"
+	$CC -O2 -DDBG_SILENT -I./src/ -o "$DIR/conway" $SOURCES -lpthread
+
+	cpus=$(getconf _NPROCESSORS_ONLN)
+	printf "%-8s %-8s %-8s %s\n" "workers" "plain" "numa" "speedup"
+	workers=1
+	while [ $workers -le $cpus ]; do
+		plain=$(elapsed "$DIR/conway" -f -r -w $workers "$DIR/large.rle")
+		numa=$(elapsed "$DIR/conway" -f -r -N -w $workers "$DIR/large.rle")
+		awk -v w=$workers -v p=$plain -v n=$numa \
+		    'BEGIN { printf("%-8d %-8.2f %-8.2f %.2f\n", w, p, n, p / n) }'
+		if [ $workers -lt $cpus ] && [ $((workers * 2)) -gt $cpus ]; then
+			workers=$cpus
+		else
+			workers=$((workers * 2))
+		fi
+	done
+	exit 0
+fi
+
+if [ $MODE = lookup ]; then
+	$CC -O2 -I./src/ -o "$DIR/lookup" bench/lookup.c \
+	    $(echo $SOURCES | sed 's# src/main.c##') -lpthread
+
+	printf "%-8s %-11s %-13s %-13s %s\n" "buckets" "layout" "hit ns" \
+	       "empty ns" "row ns/cell"
+	printf "%-8s %-11s %-13s %-13s %s\n" "" "" "index quads" \
+	       "index quads" "index quads"
+	for grid in "128 1" "128 8" "128 32" "512 1" "512 4"; do
+		set -- $grid
+		layout=dense
+		[ $2 -gt 1 ] && layout="every ${2}th"
+		"$DIR/lookup" $1 $2 | awk -v b=$(($1 * $1)) -v l="$layout" '{
+			empty = $3 " " $4
+			if (l == "dense")
+				empty = "-"
+			printf("%-8d %-11s %-13s %-13s %s %s\n", b, l, $1 " " $2,
+			       empty, $5, $6)
+		}'
+	done
+	exit 0
+fi
+
+if [ $MODE = check ]; then
+	SPACED= soup 256 256 4 > "$DIR/check.rle"
+
+	# verdict LABEL: prints whether the runs of LABEL agreed, as told
+	# by agreed.
+	verdict() {
+		result=ok
+		if [ $agreed -eq 0 ]; then
+			result=FAIL
+			failed=1
+		fi
+		printf "%-8s %-40s %s\n" "${size}x$size" "$1" "$result"
+	}
+
+	# same EXPECTED OPTIONS: writes generation 300 with both sets of
+	# options and compares them.
+	same() {
+		agreed=1
+		"$DIR/conway" -r $1 -g 300 "$DIR/check.rle" > "$DIR/expect" \
+		 && "$DIR/conway" -r $2 -g 300 "$DIR/check.rle" > "$DIR/got" \
+		 && cmp -s "$DIR/expect" "$DIR/got" || agreed=0
+		verdict "$2"
+	}
+
+	# restored EXPECTED OPTIONS GENERATION: runs OPTIONS until they
+	# exit, writing a checkpoint, and compares GENERATION restored
+	# from it with the one EXPECTED writes.
+	restored() {
+		rm -f "$DIR/saved"
+		agreed=1
+		"$DIR/conway" -r $2 -o "$DIR/saved" "$DIR/check.rle" > /dev/null \
+		 && "$DIR/conway" -r $1 -g $3 "$DIR/check.rle" > "$DIR/expect" \
+		 && "$DIR/conway" -l "$DIR/saved" -g $3 > "$DIR/got" \
+		 && cmp -s "$DIR/expect" "$DIR/got" || agreed=0
+		verdict "$2 -o, -l -g $3"
+	}
+
+	failed=0
+	for size in 16 32 64; do
+		# PARALLEL_MIN=1 splits even the smallest update between workers.
+		$CC -O2 -DDBG_SILENT -DBUCKETSZ=$size -DPARALLEL_MIN=1 -I./src/ \
+		    -o "$DIR/conway" $SOURCES -lpthread
+
+		# -g with -P steps one generation at a time under -j 0.
+		for rule in B3/S23 B36/S23; do
+			single="-R $rule -P 2 -j 0"
+			same "$single" "-R $rule"
+			same "$single" "-R $rule -w 4"
+			same "$single" "-R $rule -e hashlife"
+			same "$single" "-R $rule -P 3 -w 2"
+			same "$single" "$single -w 4 -m 4096 -x"
+			same "$single" "-R $rule -e buffered"
+		done
+		same "-T 256 -P 2 -j 0" "-T 256"
+		same "-T 256 -P 2 -j 0" "-T 256 -w 4"
+
+		# Stored inverted on odd generations only.
+		b0="-R B03/S23"
+		same "$b0 -P 2 -j 0" "$b0"
+		same "$b0 -P 2 -j 0" "$b0 -w 4"
+
+		# Without -g the headless loop stops at generation 1000, and
+		# -e buffered keeps its own engine all the way there.
+		restored "-P 2 -j 0" "-g 150" 300
+		restored "-P 2 -j 0" "-f -e buffered" 1000
+		restored "$b0 -P 2 -j 0" "$b0 -f -e buffered" 1000
+	done
+	exit $failed
+fi
+
+SPACED=  soup 512 512 1 > "$DIR/dense.rle"
+SPACED=1 soup 4096 4096 2 > "$DIR/sparse.rle"
+
+# misses COMMAND...: runs COMMAND, printing the cache misses it took,
+# or - without perf.
+misses() {
+	if ! command -v perf > /dev/null; then
+		"$@"
+		printf -- "-"
+		return
+	fi
+	perf stat -x, -e cache-misses -o "$DIR/perf" "$@"
+	awk -F, '$3 == "cache-misses" { printf("%s", $1) }' "$DIR/perf"
+}
+
+if [ $MODE = layout ]; then
+	$CC -O2 -DDBG_SILENT -I./src/ -o "$DIR/conway" $SOURCES -lpthread
+
+	printf "%-8s %-10s %-8s %s\n" "pattern" "layout" "seconds" "misses"
+	for pattern in sparse dense; do
+		for z in 0 100; do
+			layout=never
+			[ $z -gt 0 ] && layout="every $z"
+			start=$(date +%s.%N)
+			count=$(misses "$DIR/conway" -f -r -w "$WORKERS" -z $z \
+			        "$DIR/$pattern.rle")
+			end=$(date +%s.%N)
+			awk -v s="$start" -v e="$end" -v p="$pattern" -v l="$layout" \
+			    -v m="$count" \
+			    'BEGIN { printf("%-8s %-10s %-8.2f %s\n", p, l, e - s, m) }'
+		done
+	done
+	exit 0
+fi
+
+for size in 16 32 64; do
+	$CC -O2 -DDBG_SILENT -DBUCKETSZ=$size -I./src/ \
+	    -o "$DIR/conway-$size" $SOURCES -lpthread
+done
+
+printf "%-8s %-8s %s\n" "bucket" "pattern" "seconds"
+for pattern in sparse dense; do
+	for size in 16 32 64; do
+		start=$(date +%s.%N)
+		"$DIR/conway-$size" -f -r -w "$WORKERS" "$DIR/$pattern.rle"
+		end=$(date +%s.%N)
+		awk -v s="$start" -v e="$end" -v b="${size}x$size" -v p="$pattern" \
+		    'BEGIN { printf("%-8s %-8s %.2f\n", b, p, e - s) }'
+	done
+done
@@ -0,0 +1,125 @@
+/*
+ * Times get() on a grid of buckets holding a live cell each, with the
+ * index of the tree and then with it dropped, when buckets are found
+ * by walking the quads down to their leaf instead.
+ *
+ * Usage: lookup SIDE SPACING
+ *
+ * Sets SIDE by SIDE buckets, SPACING buckets apart, and prints the
+ * nanoseconds a lookup took, index first and quads second: of a live
+ * bucket, of the empty space between buckets, and per cell when
+ * reading every cell of a square of the grid in rows.
+ */
+#include "conway.h"
+
+#include <stdio.h>  /* printf, fprintf */
+#include <stdlib.h> /* atoi, malloc, rand, srand, free */
+#include <string.h> /* memset */
+#include <time.h>   /* clock_gettime */
+
+#define LOOKUPS 2000000
+#define SCAN_MAX 4096
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned long long sum;
+
+/*
+ * Returns the nanoseconds a lookup took, looking at the cells at xs,
+ * ys moved by dx, dy.
+ */
+static double lookups(struct quad *root, const coordinate *xs,
+                      const coordinate *ys, coordinate dx, coordinate dy)
+{
+	double start = now();
+	for(unsigned i = 0; i < LOOKUPS; ++i)
+		sum += get(root, xs[i] + dx, ys[i] + dy);
+	return (now() - start) * 1e9 / LOOKUPS;
+}
+
+/*
+ * Returns the nanoseconds a cell took, reading a square of side cells
+ * a row at a time.
+ */
+static double scan(struct quad *root, coordinate side)
+{
+	double start = now();
+	for(coordinate y = 0; y < side; ++y) {
+		for(coordinate x = 0; x < side; ++x)
+			sum += get(root, x, y);
+	}
+	return (now() - start) * 1e9 / ((double)side * side);
+}
+
+int main(int argc, char **argv)
+{
+	int side = argc > 1 ? atoi(argv[1]) : 0;
+	int spacing = argc > 2 ? atoi(argv[2]) : 0;
+	if (side <= 0 || spacing <= 0) {
+		fprintf(stderr, "Usage: %s SIDE SPACING\n", argv[0]);
+		return 1;
+	}
+
+	struct quad quad;
+	memset(&quad, 0, sizeof(quad));
+	quad.leaf = 1;
+
+	struct conway cw;
+	if (!conway_create(&cw, &quad, 0, 0)) {
+		fprintf(stderr, "Arena cannot be created\n");
+		return 1;
+	}
+
+	coordinate step = (coordinate)spacing * BUCKETSZ;
+	for(int by = 0; by < side; ++by) {
+		for(int bx = 0; bx < side; ++bx)
+			set(cw.root, bx * step + 5, by * step + 7, 1);
+	}
+
+	coordinate *xs = malloc(sizeof(coordinate) * LOOKUPS);
+	coordinate *ys = malloc(sizeof(coordinate) * LOOKUPS);
+	if (!xs || !ys) {
+		fprintf(stderr, "Lookups cannot be allocated\n");
+		return 1;
+	}
+	srand(3);
+	for(unsigned i = 0; i < LOOKUPS; ++i) {
+		xs[i] = (rand() % side) * step + 5;
+		ys[i] = (rand() % side) * step + 7;
+	}
+
+	coordinate cells = side * step;
+	if (cells > SCAN_MAX)
+		cells = SCAN_MAX;
+
+	double hit[2], empty[2], row[2];
+	for(unsigned walk = 0; walk < 2; ++walk) {
+		if (walk) {
+			free(cw.tree.index);
+			cw.tree.index = NULL;
+			cw.tree.index_capacity = 0;
+			cw.tree.index_count = 0;
+		}
+		hit[walk] = lookups(cw.root, xs, ys, 0, 0);
+		// The bucket to the south east, empty unless packed densely.
+		empty[walk] = spacing > 1
+		            ? lookups(cw.root, xs, ys, BUCKETSZ, BUCKETSZ) : 0;
+		row[walk] = scan(cw.root, cells);
+	}
+
+	printf("%.0f %.0f %.0f %.0f %.1f %.1f\n", hit[0], hit[1],
+	       empty[0], empty[1], row[0], row[1]);
+	if (sum == 0)
+		fprintf(stderr, "No live cell found\n");
+
+	free(xs);
+	free(ys);
+	release(cw.root);
+	conway_destroy(&cw);
+	return 0;
+}
@@ -0,0 +1,253 @@
+#include "arena.h"
+#include "topology.h"
+
+#include <stdlib.h>   /* malloc, free */
+#include <string.h>   /* memset */
+#include <sys/mman.h> /* mmap, munmap, madvise */
+
+/*
+ * Every block is a multiple of ALIGN bytes, and there is one free
+ * list for each multiple up to ARENA_MAX.
+ */
+#define ALIGN 16
+#define CLASSES (ARENA_MAX / ALIGN)
+
+#define SLABSZ (64 * 1024)
+#define HUGE_SLABSZ (2 * 1024 * 1024)
+
+struct block {
+	struct block *next;
+};
+
+struct slab {
+	struct slab *next;
+	size_t size;
+	int mapped;
+};
+#define SLAB_HEADER ((sizeof(struct slab) + ALIGN - 1) / ALIGN * ALIGN)
+
+/*
+ * Blocks carved from the slabs of one NUMA node.
+ */
+struct pool {
+	/*
+	 * Part of the newest slab of the pool not yet carved into blocks.
+	 */
+	char *top, *end;
+	struct block *free[CLASSES];
+};
+
+struct ar {
+	int huge;
+	struct slab *slabs;
+	/*
+	 * One pool for every node of topology, or just the one in pool
+	 * while topology is NULL.
+	 */
+	const struct topology *topology;
+	struct pool *pools;
+	struct pool pool;
+};
+
+int arena_create(struct arena *arena, int huge)
+{
+	if (!arena) return 0;
+
+	struct ar *a = malloc(sizeof(struct ar));
+	if (!a)
+		return 0;
+
+	memset(a, 0, sizeof(struct ar));
+	a->huge = huge;
+	a->pools = &a->pool;
+
+	memset(&arena->stats, 0, sizeof(arena->stats));
+	arena->opaque = a;
+	return 1;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	if (!arena || !arena->opaque) return;
+
+	arena_clear(arena);
+
+	struct ar *a = arena->opaque;
+	if (a->pools != &a->pool)
+		free(a->pools);
+	free(a);
+	arena->opaque = NULL;
+}
+
+void arena_clear(struct arena *arena)
+{
+	struct ar *a = arena->opaque;
+
+	struct slab *cur = a->slabs;
+	while(cur) {
+		struct slab *del = cur;
+		cur = cur->next;
+
+		if (del->mapped)
+			munmap(del, del->size);
+		else
+			free(del);
+	}
+
+	a->slabs = NULL;
+	unsigned pools = a->topology ? a->topology->nodes : 1;
+	memset(a->pools, 0, sizeof(struct pool) * pools);
+	arena->stats.resident = 0;
+}
+
+int arena_create_like(struct arena *arena, const struct arena *like)
+{
+	const struct ar *l = like->opaque;
+	if (!arena_create(arena, l->huge))
+		return 0;
+
+	if (l->topology && !arena_nodes(arena, l->topology)) {
+		arena_destroy(arena);
+		return 0;
+	}
+	return 1;
+}
+
+int arena_nodes(struct arena *arena, const struct topology *topology)
+{
+	struct ar *a = arena->opaque;
+	if (a->topology || !topology->nodes) return 0;
+
+	struct pool *pools = malloc(sizeof(struct pool) * topology->nodes);
+	if (!pools)
+		return 0;
+
+	// Whatever was carved so far stays with the first node.
+	memset(pools, 0, sizeof(struct pool) * topology->nodes);
+	pools[0] = a->pool;
+
+	a->pools = pools;
+	a->topology = topology;
+	return 1;
+}
+
+static void* map_slab(size_t size, int huge)
+{
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (huge)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		// No reserved huge pages, let transparent ones back it instead.
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		if (huge)
+			madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+	return p;
+}
+
+static int new_slab(struct arena *arena, unsigned node)
+{
+	struct ar *a = arena->opaque;
+	struct pool *pool = a->pools + node;
+
+	// Slabs of a node are mapped, to be placed before anything is written.
+	int placed = a->topology && a->topology->nodes > 1;
+
+	size_t size = SLABSZ;
+	struct slab *slab = NULL;
+	if (a->huge || placed) {
+		size = a->huge ? HUGE_SLABSZ : SLABSZ;
+		slab = map_slab(size, a->huge);
+	}
+	if (slab) {
+		if (placed)
+			topology_place(a->topology, slab, size, node);
+		slab->mapped = 1;
+	} else {
+		size = SLABSZ;
+		slab = malloc(size);
+		if (!slab)
+			return 0;
+		slab->mapped = 0;
+	}
+
+	slab->size = size;
+	slab->next = a->slabs;
+	a->slabs = slab;
+
+	pool->top = (char*)slab + SLAB_HEADER;
+	pool->end = (char*)slab + size;
+
+	arena->stats.slabs++;
+	arena->stats.resident += size;
+	return 1;
+}
+
+static unsigned size_class(size_t size)
+{
+	return size ? (size - 1) / ALIGN : 0;
+}
+
+void* arena_alloc(struct arena *arena, size_t size)
+{
+	return arena_alloc_on(arena, 0, size);
+}
+
+void arena_free(struct arena *arena, void *block, size_t size)
+{
+	arena_free_on(arena, 0, block, size);
+}
+
+void* arena_alloc_on(struct arena *arena, unsigned node, size_t size)
+{
+	struct ar *a = arena->opaque;
+	struct pool *pool = a->pools + node;
+
+	if (size > ARENA_MAX)
+		return NULL;
+
+	unsigned c = size_class(size);
+	arena->stats.allocations++;
+
+	struct block *b = pool->free[c];
+	if (b) {
+		pool->free[c] = b->next;
+		arena->stats.reused++;
+		return b;
+	}
+
+	size = (c + 1) * ALIGN;
+	if ((size_t)(pool->end - pool->top) < size && !new_slab(arena, node)) {
+		arena->stats.allocations--;
+		return NULL;
+	}
+
+	void *p = pool->top;
+	pool->top += size;
+	return p;
+}
+
+void arena_free_on(struct arena *arena, unsigned node, void *block,
+                   size_t size)
+{
+	struct ar *a = arena->opaque;
+	struct pool *pool = a->pools + node;
+
+	if (!block)
+		return;
+
+	unsigned c = size_class(size);
+	struct block *b = block;
+	b->next = pool->free[c];
+	pool->free[c] = b;
+
+	arena->stats.frees++;
+}
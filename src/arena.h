@@ -0,0 +1,84 @@
+#include <stddef.h> /* size_t */
+
+struct topology;
+
+struct arena_stats {
+	/*
+	 * Blocks handed out, and the part of them taken from a free
+	 * list rather than carved from a slab.
+	 */
+	unsigned long long allocations, reused;
+	/*
+	 * Blocks given back to the free lists.
+	 */
+	unsigned long long frees;
+	/*
+	 * Slabs requested from the system, and the bytes they span.
+	 */
+	unsigned long long slabs;
+	size_t resident;
+};
+
+struct arena {
+	struct arena_stats stats;
+	void *opaque;
+};
+
+/*
+ * Largest block handed out by arena_alloc.
+ */
+#define ARENA_MAX 2048
+
+/*
+ * Creates an arena handing out blocks of up to ARENA_MAX bytes,
+ * carved from slabs and recycled through one free list per size.
+ * When huge is non-zero the slabs are backed by huge pages where
+ * the system allows it.
+ *
+ * An arena is not thread safe.
+ *
+ * Returns non-zero on success.
+ */
+int arena_create(struct arena *arena, int huge);
+/*
+ * Creates an empty arena with the huge pages and nodes of like.
+ *
+ * Returns non-zero on success.
+ */
+int arena_create_like(struct arena *arena, const struct arena *like);
+/*
+ * Gives every slab back to the system and deallocates the arena.
+ */
+void arena_destroy(struct arena *arena);
+/*
+ * Gives every slab back to the system, invalidating all blocks
+ * handed out so far. The arena may be used again afterwards.
+ */
+void arena_clear(struct arena *arena);
+/*
+ * Splits the arena into one pool of slabs for every node of topology,
+ * which must outlive it, each placed in the memory of its node. The
+ * blocks handed out so far belong to the first node. May only be
+ * called once.
+ *
+ * Returns non-zero on success.
+ */
+int arena_nodes(struct arena *arena, const struct topology *topology);
+
+/*
+ * Returns a block of at least size bytes, aligned for any type,
+ * or NULL when out of memory.
+ */
+void* arena_alloc(struct arena *arena, size_t size);
+/*
+ * Returns a block to the arena. size must be the one it was
+ * allocated with.
+ */
+void arena_free(struct arena *arena, void *block, size_t size);
+/*
+ * As arena_alloc and arena_free, for the pool of node. Without
+ * arena_nodes there is only node zero.
+ */
+void* arena_alloc_on(struct arena *arena, unsigned node, size_t size);
+void arena_free_on(struct arena *arena, unsigned node, void *block,
+                   size_t size);
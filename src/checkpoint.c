@@ -0,0 +1,253 @@
+#include <stdio.h>     /* FILE, fopen, fwrite, fclose, rename, remove */
+
+#include "conway.h"
+#include "load.h"
+#include "checkpoint.h"
+
+#include <stdlib.h>    /* malloc, realloc, free, qsort */
+#include <string.h>    /* memcmp, memcpy, strlen */
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close, fsync */
+#include <sys/mman.h>  /* mmap, munmap, madvise */
+#include <sys/stat.h>  /* fstat */
+
+#define MAGIC "CONWAYCK"
+#define VERSION 1
+
+#define CELL_BYTES (BUCKETSZ * BUCKETSZ / VALUE_BIT * sizeof(value))
+
+struct header {
+	char magic[8];
+	uint32_t version, bucketsz;
+	uint64_t generation, torus;
+	/*
+	 * Number of buckets that follow.
+	 */
+	uint64_t count;
+	uint16_t born, survive;
+	uint32_t phase;
+	uint64_t reserved[2];
+};
+
+/*
+ * Coordinates of a bucket, in buckets.
+ */
+struct entry {
+	uint64_t x, y;
+};
+
+// {{{1 save
+
+struct item {
+	uint64_t key;
+	struct bucket *bucket;
+};
+
+struct items {
+	size_t length, capacity;
+	struct item *items;
+};
+
+static int compare_items(const void *a, const void *b)
+{
+	const struct item *p = a, *q = b;
+	if (p->key != q->key)
+		return p->key < q->key ? -1 : 1;
+
+	// Only buckets 2^32 apart share a key.
+	if (p->bucket->y != q->bucket->y)
+		return p->bucket->y < q->bucket->y ? -1 : 1;
+	if (p->bucket->x != q->bucket->x)
+		return p->bucket->x < q->bucket->x ? -1 : 1;
+	return 0;
+}
+
+static int collect(struct quad *quad, struct items *items)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i) {
+			if (!collect(quad->children[i], items))
+				return 0;
+		}
+		return 1;
+	}
+
+	for(struct bucket *b = quad->items.head; b; b = b->next) {
+		if (items->length == items->capacity) {
+			size_t new_cap = items->capacity ? items->capacity * 2 : 256;
+			void *tmp = realloc(items->items, new_cap * sizeof(struct item));
+			if (!tmp)
+				return 0;
+			items->items = tmp;
+			items->capacity = new_cap;
+		}
+
+		struct item *it = items->items + items->length++;
+		it->key = morton(b->x, b->y);
+		it->bucket = b;
+	}
+	return 1;
+}
+
+static int write_items(FILE *stream, struct conway *cw, struct items *items)
+{
+	struct header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(h.magic));
+	h.version = VERSION;
+	h.bucketsz = BUCKETSZ;
+	h.generation = cw->generation;
+	h.torus = cw->tree.torus;
+	h.count = items->length;
+	h.born = cw->rule.born;
+	h.survive = cw->rule.survive;
+	h.phase = cw->phase;
+
+	if (fwrite(&h, sizeof(h), 1, stream) != 1)
+		return 0;
+
+	for(size_t i = 0; i < items->length; ++i) {
+		struct entry e = { items->items[i].bucket->x,
+		                   items->items[i].bucket->y };
+		if (fwrite(&e, sizeof(e), 1, stream) != 1)
+			return 0;
+	}
+
+	for(size_t i = 0; i < items->length; ++i) {
+		if (fwrite(items->items[i].bucket->bucket, CELL_BYTES, 1,
+		           stream) != 1)
+			return 0;
+	}
+
+	return fflush(stream) == 0 && fsync(fileno(stream)) == 0;
+}
+
+int checkpoint_save(struct conway *cw, const char *path)
+{
+	if (!cw || !path) return 0;
+
+	struct items items = { 0, 0, NULL };
+	if (!collect(cw->root, &items)) {
+		free(items.items);
+		return 0;
+	}
+	qsort(items.items, items.length, sizeof(struct item), compare_items);
+
+	// Write next to path, so that a crash leaves the last one intact.
+	size_t len = strlen(path);
+	char *tmp = malloc(len + sizeof(".tmp"));
+	if (!tmp) {
+		free(items.items);
+		return 0;
+	}
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+	int ok = 0;
+	FILE *stream = fopen(tmp, "wb");
+	if (stream) {
+		ok = write_items(stream, cw, &items);
+		ok = fclose(stream) == 0 && ok;
+		ok = ok && rename(tmp, path) == 0;
+		if (!ok)
+			remove(tmp);
+	}
+
+	free(tmp);
+	free(items.items);
+	return ok;
+}
+
+// 1}}}
+
+// {{{1 restore
+
+static int valid(const struct header *h, size_t size, coordinate torus)
+{
+	if (memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0)
+		return 0;
+	if (h->version != VERSION || h->bucketsz != BUCKETSZ)
+		return 0;
+	if (h->torus != torus)
+		return 0;
+
+	uint64_t each = sizeof(struct entry) + CELL_BYTES;
+	if (h->count > (size - sizeof(*h)) / each)
+		return 0;
+	return size == sizeof(*h) + h->count * each;
+}
+
+static void extend(struct bounds *bounds, const struct entry *e, int first)
+{
+	// Coordinates above COORD_MAX/2 are negative.
+	int64_t x = (int64_t)(coordinate)(e->x * BUCKETSZ);
+	int64_t y = (int64_t)(coordinate)(e->y * BUCKETSZ);
+
+	if (first || x < (int64_t)bounds->west)
+		bounds->west = x;
+	if (first || x + BUCKETSZ - 1 > (int64_t)bounds->east)
+		bounds->east = x + BUCKETSZ - 1;
+	if (first || y < (int64_t)bounds->north)
+		bounds->north = y;
+	if (first || y + BUCKETSZ - 1 > (int64_t)bounds->south)
+		bounds->south = y + BUCKETSZ - 1;
+}
+
+int checkpoint_restore(struct conway *cw, struct bounds *bounds,
+                       const char *path)
+{
+	if (!cw || !path) return 0;
+	if (!cw->root->leaf || cw->root->count) return 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct header)) {
+		close(fd);
+		return 0;
+	}
+
+	size_t size = st.st_size;
+	const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+#ifdef MADV_SEQUENTIAL
+	madvise((void*)map, size, MADV_SEQUENTIAL);
+#endif
+
+	struct header h;
+	memcpy(&h, map, sizeof(h));
+
+	struct rule rule = { h.born, h.survive };
+	if (!valid(&h, size, cw->tree.torus) || !conway_rule(cw, &rule)) {
+		munmap((void*)map, size);
+		return 0;
+	}
+	cw->generation = h.generation;
+	cw->phase = h.phase != 0;
+
+	const struct entry *entries = (const void*)(map + sizeof(h));
+	const value *cells = (const void*)(entries + h.count);
+
+	struct quad *hint = cw->root;
+	for(uint64_t i = 0; i < h.count; ++i) {
+		hint = set_bucket(hint, entries[i].x, entries[i].y,
+		                  cells + i * (CELL_BYTES / sizeof(value)));
+		if (!hint) {
+			munmap((void*)map, size);
+			return 0;
+		}
+		if (bounds)
+			extend(bounds, entries + i, i == 0);
+	}
+	if (bounds && h.count)
+		bounds->w_set = bounds->e_set = bounds->n_set = bounds->s_set = 1;
+
+	munmap((void*)map, size);
+	return 1;
+}
+
+// 1}}}
@@ -0,0 +1,30 @@
+
+/*
+ * A checkpoint holds the buckets of a universe along with its rule and
+ * generation: a header, the coordinates of every bucket in Morton order,
+ * and then the cells of every bucket in the same order, as they are
+ * laid out in struct bucket.
+ *
+ * Checkpoints are written in the byte order of the machine, and can only
+ * be restored by a build with the same BUCKETSZ.
+ */
+
+/*
+ * Writes the cells of cw to path, replacing it only once the whole
+ * checkpoint has been written. May be called between any two steps.
+ *
+ * Returns non-zero on success.
+ */
+int checkpoint_save(struct conway *cw, const char *path);
+
+/*
+ * Restores the checkpoint in path into cw, whose root must be empty,
+ * and whose torus must be the one the checkpoint was written from.
+ * The file is mapped into memory and the buckets set a whole at a
+ * time. When bounds is non-NULL, it is set to the bounds of the
+ * buckets restored. Must be called before conway_engine.
+ *
+ * Returns non-zero on success.
+ */
+int checkpoint_restore(struct conway *cw, struct bounds *bounds,
+                       const char *path);
@@ -1,40 +1,146 @@
 #include "conway.h"
 
 #include "work_queue.h"
+#include "kernel.h"
+#include "hashlife.h"
+#include "topology.h"
+#include "memo.h"
 
-#include <stdlib.h> /* malloc, realloc, free */
+#include <stdlib.h> /* malloc, calloc, realloc, free */
 #include <assert.h> /* assert */
 #include <string.h> /* memset */
 #include <pthread.h>
 
 #define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2*!!(cond)]))
 
+/*
+ * Bucket coordinates run from 0 to BUCKET_MAX, and wrap around.
+ */
+#define BUCKET_MAX (COORD_MAX / BUCKETSZ)
+
+/*
+ * Shared part of a state_change_buffer.
+ * Worker threads append to a segment of their own without locking,
+ * anyone else appends to the buffer itself under the mutex.
+ */
+struct change_segments {
+	pthread_mutex_t mutex;
+	unsigned length, locked;
+	struct state_change_buffer *items;
+	/*
+	 * Buckets stepped and skipped by the workers since the last merge.
+	 */
+	unsigned stepped, skipped;
+	/*
+	 * Buckets of those stepped found in the memo.
+	 */
+	unsigned remembered;
+	/*
+	 * Non-zero when changes of the step were lost for lack of
+	 * memory, which fails it.
+	 */
+	unsigned failed;
+};
 
-int conway_create(struct conway *cw, struct quad *root)
+int conway_create(struct conway *cw, struct quad *root, int huge_pages,
+                  coordinate torus)
 {
 	BUILD_BUG_ON(BUCKETSZ % VALUE_BIT); // Size of bucket(BUCKETSZ) must be evenly divisible by the numberof bytes in the value-word.
 
 	if (!cw) return 0;
 	if (!root) return 0;
+	if (!root->leaf || root->count) return 0;
+	if (torus % BUCKETSZ || (torus && torus - 1 > COORD_MAX / 2)) return 0;
 
-	pthread_mutex_t *mut = malloc(sizeof(pthread_mutex_t));
-	if (!mut)
+	struct change_segments *seg = malloc(sizeof(struct change_segments));
+	if (!seg)
 		return 0;
 
-	int err = pthread_mutex_init(mut, NULL);
+	int err = pthread_mutex_init(&seg->mutex, NULL);
 	if (err) {
-		free(mut);
+		free(seg);
+		return 0;
+	}
+
+	if (!arena_create(&cw->tree.arena, huge_pages)) {
+		pthread_mutex_destroy(&seg->mutex);
+		free(seg);
 		return 0;
 	}
+	cw->tree.torus = torus;
+	cw->tree.rule = RULE_CONWAY;
+	cw->tree.stride = 1;
+	cw->tree.index = NULL;
+	cw->tree.index_capacity = 0;
+	cw->tree.index_count = 0;
+	cw->tree.nodes = 1;
+	cw->tree.memo = NULL;
+
+	root->tree = &cw->tree;
+	root->west = 0;
+	root->north = 0;
+	root->east = torus ? torus / BUCKETSZ : 1;
+	root->south = root->east;
+	root->population = 0;
+	memset(&root->box, 0, sizeof(root->box));
+	root->dirty = 0;
+	seg->length = 0;
+	seg->locked = 0;
+	seg->items = NULL;
+	seg->stepped = 0;
+	seg->skipped = 0;
+	seg->remembered = 0;
+	seg->failed = 0;
 
 	cw->root = root;
 	cw->changes.length = 0;
 	cw->changes.capacity = 0;
 	cw->changes.items = 0;
-	cw->changes.opaque = mut;
+	cw->changes.buckets_length = 0;
+	cw->changes.buckets_capacity = 0;
+	cw->changes.buckets = NULL;
+	cw->changes.opaque = seg;
 	cw->opaque = NULL;
 	cw->generation = 0;
+	cw->stride = 1;
+	cw->engine = ENGINE_BUCKET;
+	cw->rule = RULE_CONWAY;
+	cw->phases[0] = RULE_CONWAY;
+	cw->phases[1] = RULE_CONWAY;
+	cw->phase = 0;
+	memset(&cw->stats, 0, sizeof(cw->stats));
+
+	return 1;
+}
+
+int conway_numa(struct conway *cw, const struct topology *topology)
+{
+	if (!cw || !topology) return 0;
+	if (!cw->root->leaf || cw->root->count) return 0;
+
+	if (!arena_nodes(&cw->tree.arena, topology))
+		return 0;
+	cw->tree.nodes = topology->nodes;
+	return 1;
+}
+
+int conway_memo(struct conway *cw, size_t entries)
+{
+	if (!cw) return 0;
 
+	struct memo *memo = malloc(sizeof(struct memo));
+	if (!memo)
+		return 0;
+	if (!memo_create(memo, entries)) {
+		free(memo);
+		return 0;
+	}
+
+	if (cw->tree.memo) {
+		memo_destroy(cw->tree.memo);
+		free(cw->tree.memo);
+	}
+	cw->tree.memo = memo;
 	return 1;
 }
 
@@ -42,10 +148,19 @@ void conway_destroy(struct conway *cw)
 {
 	if (!cw) return;
 
-	pthread_mutex_t *mut = cw->changes.opaque;
-	if (mut) {
-		pthread_mutex_destroy(mut);
-		free(mut);
+	conway_engine(cw, ENGINE_BUCKET, 0);
+
+	struct change_segments *seg = cw->changes.opaque;
+	if (seg) {
+		for(unsigned i = 0; i < seg->length; ++i) {
+			free(seg->items[i].items);
+			free(seg->items[i].buckets);
+		}
+		free(seg->items);
+
+		pthread_mutex_destroy(&seg->mutex);
+		free(seg);
+		cw->changes.opaque = NULL;
 	}
 
 	if (cw->changes.capacity > 0) {
@@ -54,28 +169,209 @@ void conway_destroy(struct conway *cw)
 		cw->changes.length = 0;
 		cw->changes.capacity = 0;
 	}
+	free(cw->changes.buckets);
+	cw->changes.buckets = NULL;
+	cw->changes.buckets_length = 0;
+	cw->changes.buckets_capacity = 0;
+
+	if (cw->root && cw->root->tree == &cw->tree) {
+		release(cw->root);
+		cw->root->tree = NULL;
+	}
+	arena_destroy(&cw->tree.arena);
+	free(cw->tree.index);
+	cw->tree.index = NULL;
+
+	if (cw->tree.memo) {
+		memo_destroy(cw->tree.memo);
+		free(cw->tree.memo);
+		cw->tree.memo = NULL;
+	}
 }
 
-static int append(struct state_change_buffer *buf,
-                  coordinate x, coordinate y, value v)
+/*
+ * Marks every bucket below quad to be stepped.
+ */
+static void wake_all(struct quad *quad)
 {
-	assert(buf);
-	assert(buf->opaque);
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i)
+			wake_all(quad->children[i]);
+		return;
+	}
+
+	for(struct bucket *cur = quad->items.head; cur; cur = cur->next)
+		cur->active = 1;
+}
+
+/*
+ * Marks every bucket below quad to be stepped, and forgets what the
+ * buffered engine changed around it.
+ */
+static void restart_all(struct quad *quad)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i)
+			restart_all(quad->children[i]);
+		return;
+	}
+
+	for(struct bucket *cur = quad->items.head; cur; cur = cur->next) {
+		cur->active = 1;
+		cur->touched = 0;
+	}
+}
+
+int conway_engine(struct conway *cw, enum conway_engine engine,
+                  unsigned log_stride)
+{
+	if (!cw) return 0;
+
+	if (cw->engine == ENGINE_HASHLIFE) {
+		hashlife_destroy(cw->opaque);
+		free(cw->opaque);
+		cw->opaque = NULL;
+	}
+
+	cw->engine = ENGINE_BUCKET;
+	cw->stride = 1;
+	cw->tree.stride = 1;
+
+	// Which buckets are left alone depends on the engine and stride.
+	restart_all(cw->root);
+
+	switch(engine) {
+	case ENGINE_BUCKET:
+		if (log_stride >= sizeof(cw->stride) * 8
+		 || (1u << log_stride) > BUCKETSZ)
+			return 0;
+		if (log_stride && (cw->phase || (cw->rule.born & 1)))
+			return 0;
+
+		cw->stride = 1u << log_stride;
+		cw->tree.stride = cw->stride;
+		return 1;
+	case ENGINE_BUFFERED:
+		if (log_stride)
+			return 0;
+		cw->engine = ENGINE_BUFFERED;
+		return 1;
+	case ENGINE_HASHLIFE:
+		if (log_stride >= sizeof(cw->stride) * 8)
+			return 0;
+		if (cw->tree.torus) // HashLife only knows unbounded universes
+			return 0;
+		if (cw->phase || (cw->rule.born & 1)) // Nor empty space coming alive
+			return 0;
+
+		cw->opaque = malloc(sizeof(struct hashlife));
+		if (!cw->opaque)
+			return 0;
+
+		if (!hashlife_create(cw->opaque, cw->root, log_stride,
+		                     &cw->rule)) {
+			free(cw->opaque);
+			cw->opaque = NULL;
+			return 0;
+		}
+
+		cw->engine = ENGINE_HASHLIFE;
+		cw->stride = 1u << log_stride;
+		return 1;
+	}
+	return 0;
+}
+
+// {{{1 rule
+
+int rule_parse(struct rule *rule, const char *spec)
+{
+	if (!rule || !spec) return 0;
+
+	struct rule r = { 0, 0 };
+	unsigned short *table = NULL;
+	int seen_b = 0, seen_s = 0;
+
+	for(const char *c = spec; *c; ++c) {
+		if ((*c == 'B' || *c == 'b') && !seen_b) {
+			table = &r.born;
+			seen_b = 1;
+		} else if ((*c == 'S' || *c == 's') && !seen_s) {
+			table = &r.survive;
+			seen_s = 1;
+		} else if (*c >= '0' && *c <= '8' && table) {
+			*table |= 1 << (*c - '0');
+		} else if (*c != '/' || !table) {
+			return 0;
+		}
+	}
+	if (!seen_b || !seen_s)
+		return 0;
+
+	*rule = r;
+	return 1;
+}
 
-	pthread_mutex_t *mut = buf->opaque;
+/*
+ * Rule giving the inverse of what rule gives.
+ */
+static struct rule invert_output(struct rule rule)
+{
+	struct rule r = { ~rule.born & 0x1ff, ~rule.survive & 0x1ff };
+	return r;
+}
+
+/*
+ * Rule giving for inverted cells what rule gives for the cells
+ * themselves: dead cells are live ones, with the other neighbours.
+ */
+static struct rule invert_input(struct rule rule)
+{
+	struct rule r = { 0, 0 };
+	for(unsigned n = 0; n <= 8; ++n) {
+		r.born    |= ((rule.survive >> (8 - n)) & 1) << n;
+		r.survive |= ((rule.born    >> (8 - n)) & 1) << n;
+	}
+	return r;
+}
+
+int conway_rule(struct conway *cw, const struct rule *rule)
+{
+	if (!cw) return 0;
+	if (!rule) return 0;
+	if (cw->phase) return 0;
+	if ((cw->engine == ENGINE_HASHLIFE || cw->stride > 1)
+	 && (rule->born & 1)) return 0;
+
+	cw->rule = *rule;
+	if (rule->born & 1) {
+		// Store the cells inverted after a B0 step, so that empty
+		// space stays empty, and as they are after the next one
+		// unless it was S8 and everything lives on.
+		cw->phases[0] = invert_output(*rule);
+		cw->phases[1] = invert_input(*rule);
+		if (rule->survive & (1 << 8))
+			cw->phases[1] = invert_output(cw->phases[1]);
+	} else {
+		cw->phases[0] = *rule;
+		cw->phases[1] = *rule;
+	}
+	return 1;
+}
 
-	pthread_mutex_lock(mut);
+// 1}}}
 
+static int push(struct state_change_buffer *buf,
+                coordinate x, coordinate y, value v)
+{
 	if (buf->length == buf->capacity) {
 		unsigned new_cap = buf->capacity * 2;
 		if (new_cap == 0)
 			new_cap = 8;
 		void *tmp = realloc(buf->items,
 		                    sizeof(struct state_change) * new_cap);
-		if (!tmp) {
-			pthread_mutex_unlock(mut);
+		if (!tmp)
 			return 0;
-		}
 		buf->items = tmp;
 		buf->capacity = new_cap;
 	}
@@ -84,11 +380,212 @@ static int append(struct state_change_buffer *buf,
 	buf->items[i].x = x;
 	buf->items[i].y = y;
 	buf->items[i].v = v;
+	return 1;
+}
+
+static int push_bucket(struct state_change_buffer *buf,
+                       const struct bucket_change *change)
+{
+	if (buf->buckets_length == buf->buckets_capacity) {
+		unsigned new_cap = buf->buckets_capacity * 2;
+		if (new_cap == 0)
+			new_cap = 8;
+		void *tmp = realloc(buf->buckets,
+		                    sizeof(struct bucket_change) * new_cap);
+		if (!tmp)
+			return 0;
+		buf->buckets = tmp;
+		buf->buckets_capacity = new_cap;
+	}
+
+	buf->buckets[buf->buckets_length++] = *change;
+	return 1;
+}
+
+int append(struct state_change_buffer *buf,
+           coordinate x, coordinate y, value v)
+{
+	assert(buf);
+	assert(buf->opaque);
+
+	struct change_segments *seg = buf->opaque;
+
+	int self = workq_self();
+	if (self >= 0 && (unsigned)self < seg->length)
+		return push(seg->items + self, x, y, v);
+
+	pthread_mutex_lock(&seg->mutex);
+	int ok = push(buf, x, y, v);
+	seg->locked++;
+	pthread_mutex_unlock(&seg->mutex);
+
+	return ok;
+}
+
+int append_bucket(struct state_change_buffer *buf,
+                  const struct bucket_change *change)
+{
+	assert(buf);
+	assert(buf->opaque);
+
+	struct change_segments *seg = buf->opaque;
+
+	int self = workq_self();
+	if (self >= 0 && (unsigned)self < seg->length)
+		return push_bucket(seg->items + self, change);
+
+	pthread_mutex_lock(&seg->mutex);
+	int ok = push_bucket(buf, change);
+	seg->locked++;
+	pthread_mutex_unlock(&seg->mutex);
+
+	return ok;
+}
+
+/*
+ * Records that changes of the step were lost for lack of memory, for
+ * conway_step to fail.
+ */
+static void fail_step(struct state_change_buffer *buf)
+{
+	struct change_segments *seg = buf->opaque;
+	__atomic_store_n(&seg->failed, 1, __ATOMIC_RELAXED);
+}
+
+int expand(struct state_change_buffer *buf)
+{
+	for(unsigned i = 0; i < buf->buckets_length; ++i) {
+		struct bucket_change *c = buf->buckets + i;
+
+		for(unsigned j = 0; j < BUCKETSZ * BUCKETSZ / VALUE_BIT; ++j) {
+			for(unsigned k = 0; k < VALUE_BIT; ++k) {
+				if (!((c->born[j] | c->died[j]) >> k & 1))
+					continue;
+
+				coordinate cell = j * VALUE_BIT + k;
+				coordinate x = c->x * BUCKETSZ + cell % BUCKETSZ;
+				coordinate y = c->y * BUCKETSZ + cell / BUCKETSZ;
+				if (!push(buf, x, y, (c->born[j] >> k) & 1))
+					return 0;
+			}
+		}
+	}
 
-	pthread_mutex_unlock(mut);
+	buf->buckets_length = 0;
 	return 1;
 }
 
+/*
+ * Makes sure there is a segment for each of the given number of
+ * workers. Must not be called while workers are appending.
+ */
+static void reserve_segments(struct state_change_buffer *buf,
+                             unsigned workers)
+{
+	struct change_segments *seg = buf->opaque;
+
+	if (seg->length >= workers)
+		return;
+
+	void *tmp = realloc(seg->items,
+	                    sizeof(struct state_change_buffer) * workers);
+	if (!tmp)
+		return; // Workers without a segment take the lock instead
+	seg->items = tmp;
+
+	for(unsigned i = seg->length; i < workers; ++i) {
+		seg->items[i].length = 0;
+		seg->items[i].capacity = 0;
+		seg->items[i].opaque = NULL;
+		seg->items[i].items = NULL;
+		seg->items[i].buckets_length = 0;
+		seg->items[i].buckets_capacity = 0;
+		seg->items[i].buckets = NULL;
+	}
+	seg->length = workers;
+}
+
+unsigned gather(struct state_change_buffer *buf)
+{
+	struct change_segments *seg = buf->opaque;
+
+	unsigned length = buf->length;
+	unsigned buckets = buf->buckets_length;
+	for(unsigned i = 0; i < seg->length; ++i) {
+		length += seg->items[i].length;
+		buckets += seg->items[i].buckets_length;
+	}
+
+	if (length > buf->capacity) {
+		void *tmp = realloc(buf->items,
+		                    sizeof(struct state_change) * length);
+		if (!tmp) {
+			fail_step(buf);
+			return 0;
+		}
+		buf->items = tmp;
+		buf->capacity = length;
+	}
+	if (buckets > buf->buckets_capacity) {
+		void *tmp = realloc(buf->buckets,
+		                    sizeof(struct bucket_change) * buckets);
+		if (!tmp) {
+			fail_step(buf);
+			return 0;
+		}
+		buf->buckets = tmp;
+		buf->buckets_capacity = buckets;
+	}
+
+	unsigned merged = 0;
+	for(unsigned i = 0; i < seg->length; ++i) {
+		struct state_change_buffer *s = seg->items + i;
+
+		if (s->length)
+			memcpy(buf->items + buf->length, s->items,
+			       sizeof(struct state_change) * s->length);
+		buf->length += s->length;
+		merged += s->length;
+		s->length = 0;
+
+		if (s->buckets_length)
+			memcpy(buf->buckets + buf->buckets_length, s->buckets,
+			       sizeof(struct bucket_change) * s->buckets_length);
+		buf->buckets_length += s->buckets_length;
+		merged += s->buckets_length;
+		s->buckets_length = 0;
+	}
+
+	return merged;
+}
+
+/*
+ * Merges the segments of cw->changes, and counts how the changes
+ * were appended and how many buckets were stepped.
+ *
+ * Returns zero when changes of the step were lost.
+ */
+static int merge(struct conway *cw)
+{
+	struct change_segments *seg = cw->changes.opaque;
+
+	cw->stats.unlocked += gather(&cw->changes);
+	cw->stats.locked += seg->locked;
+	seg->locked = 0;
+
+	if (seg->stepped || seg->skipped) {
+		cw->stats.stepped += seg->stepped;
+		cw->stats.skipped += seg->skipped;
+		cw->stats.last_stepped = seg->stepped;
+		cw->stats.last_skipped = seg->skipped;
+		cw->stats.remembered += seg->remembered;
+		seg->stepped = 0;
+		seg->skipped = 0;
+		seg->remembered = 0;
+	}
+	return !seg->failed;
+}
+
 // {{{1 is_in_{bucket,quad}
 
 static int is_in_bucket(struct bucket *bucket, coordinate x, coordinate y)
@@ -97,12 +594,181 @@ static int is_in_bucket(struct bucket *bucket, coordinate x, coordinate y)
 	    && bucket->y == y / BUCKETSZ;
 }
 
+/*
+ * Returns the number of buckets from a to b, going east or south.
+ */
+static coordinate span(coordinate a, coordinate b)
+{
+	return (b - a) & BUCKET_MAX;
+}
+
 static int is_in_quad(struct quad *quad, coordinate x, coordinate y)
 {
 	coordinate qx = x / BUCKETSZ;
 	coordinate qy = y / BUCKETSZ;
-	return quad->west  <= qx && quad->east  > qx
-	    && quad->north <= qy && quad->south > qy;
+	return span(quad->west, qx) < span(quad->west, quad->east)
+	    && span(quad->north, qy) < span(quad->north, quad->south);
+}
+
+/*
+ * Wraps the coordinate c around the torus, if the tree is one.
+ * Coordinates above COORD_MAX/2 are taken to be negative.
+ */
+static coordinate wrap(struct tree *tree, coordinate c)
+{
+	if (!tree || !tree->torus || c < tree->torus)
+		return c;
+
+	int64_t p = (int64_t)c % (int64_t)tree->torus;
+	if (p < 0)
+		p += tree->torus;
+	return p;
+}
+
+// 1}}}
+
+// {{{1 index
+
+/*
+ * Smallest number of slots in the index. It is kept at most half full.
+ */
+#define INDEX_MIN 64
+
+/*
+ * Spreads the low 32 bits of c out to the even bits of the result.
+ */
+static uint64_t spread(coordinate c)
+{
+	uint64_t v = c & 0xffffffff;
+	v = (v | v << 16) & 0x0000ffff0000ffff;
+	v = (v | v << 8)  & 0x00ff00ff00ff00ff;
+	v = (v | v << 4)  & 0x0f0f0f0f0f0f0f0f;
+	v = (v | v << 2)  & 0x3333333333333333;
+	v = (v | v << 1)  & 0x5555555555555555;
+	return v;
+}
+
+uint64_t morton(coordinate bx, coordinate by)
+{
+	return spread(bx) | spread(by) << 1;
+}
+
+/*
+ * Returns the home slot of the bucket at bx, by with Morton code key.
+ * Each 2 by 2 square of buckets gets four slots in a row, a cache line,
+ * and the squares are scattered by a hash of the remaining bits.
+ */
+static size_t index_home(const struct tree *tree, uint64_t key,
+                         coordinate bx, coordinate by)
+{
+	uint64_t square = key >> 2 ^ bx >> 32 ^ by >> 32 << 28;
+	uint64_t h = (square * 0x9e3779b97f4a7c15) >> 32;
+	return (h << 2 | (key & 3)) & (tree->index_capacity - 1);
+}
+
+static struct bucket* index_find(const struct tree *tree,
+                                 coordinate bx, coordinate by)
+{
+	size_t mask = tree->index_capacity - 1;
+	uint64_t key = morton(bx, by);
+	size_t i = index_home(tree, key, bx, by);
+	for(;; i = (i + 1) & mask) {
+		const struct index_slot *slot = tree->index + i;
+		if (!slot->bucket)
+			return NULL;
+		if (slot->key == key
+		 && slot->bucket->x == bx && slot->bucket->y == by)
+			return slot->bucket;
+	}
+}
+
+static void index_put(struct tree *tree, struct bucket *bucket)
+{
+	size_t mask = tree->index_capacity - 1;
+	uint64_t key = morton(bucket->x, bucket->y);
+	size_t i = index_home(tree, key, bucket->x, bucket->y);
+	while(tree->index[i].bucket)
+		i = (i + 1) & mask;
+
+	tree->index[i].key = key;
+	tree->index[i].bucket = bucket;
+	tree->index_count++;
+}
+
+static void index_fill(struct tree *tree, struct quad *quad)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i)
+			index_fill(tree, quad->children[i]);
+		return;
+	}
+
+	for(struct bucket *cur = quad->items.head; cur; cur = cur->next)
+		index_put(tree, cur);
+}
+
+/*
+ * Rebuilds the index from every bucket in the tree of quad, with
+ * room for as many again. Drops the index when out of memory.
+ */
+static void index_rebuild(struct quad *quad)
+{
+	struct tree *tree = quad->tree;
+	while(quad->parent)
+		quad = quad->parent;
+
+	size_t capacity = INDEX_MIN;
+	while(capacity < (size_t)quad->count * 4)
+		capacity *= 2;
+
+	free(tree->index);
+	tree->index = calloc(capacity, sizeof(struct index_slot));
+	tree->index_capacity = tree->index ? capacity : 0;
+	tree->index_count = 0;
+	if (tree->index)
+		index_fill(tree, quad);
+}
+
+/*
+ * Adds bucket, which leaf already holds, to the index.
+ */
+static void index_insert(struct quad *leaf, struct bucket *bucket)
+{
+	struct tree *tree = leaf->tree;
+	if (!tree)
+		return;
+
+	if (!tree->index || (tree->index_count + 1) * 2 > tree->index_capacity)
+		index_rebuild(leaf);
+	else
+		index_put(tree, bucket);
+}
+
+static void index_remove(struct tree *tree, struct bucket *bucket)
+{
+	if (!tree || !tree->index)
+		return;
+
+	size_t mask = tree->index_capacity - 1;
+	uint64_t key = morton(bucket->x, bucket->y);
+	size_t i = index_home(tree, key, bucket->x, bucket->y);
+	while(tree->index[i].bucket != bucket)
+		i = (i + 1) & mask;
+
+	// Moves the rest of the cluster back over the hole, unless that
+	// would put an entry before its home slot.
+	for(size_t j = (i + 1) & mask; tree->index[j].bucket; j = (j + 1) & mask) {
+		struct index_slot *slot = tree->index + j;
+		size_t home = index_home(tree, slot->key,
+		                         slot->bucket->x, slot->bucket->y);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			tree->index[i] = *slot;
+			i = j;
+		}
+	}
+
+	tree->index[i].bucket = NULL;
+	tree->index_count--;
 }
 
 // 1}}}
@@ -133,11 +799,19 @@ static struct quad* find_quad(struct quad *quad, coordinate x, coordinate y)
 	}
 }
 
+/*
+ * Returns the bucket holding the cell at x, y, or NULL. The leaf is
+ * only searched for when leaf_quad asks for it, the index is used
+ * otherwise.
+ */
 static struct bucket* find_bucket(struct quad *quad, coordinate x, coordinate y,
                                   struct quad **leaf_quad)
 {
 	assert(quad);
 
+	if (!leaf_quad && quad->tree && quad->tree->index)
+		return index_find(quad->tree, x / BUCKETSZ, y / BUCKETSZ);
+
 	struct quad *leaf = find_quad(quad, x, y);
 
 	if (leaf_quad)
@@ -159,57 +833,265 @@ static struct bucket* find_bucket(struct quad *quad, coordinate x, coordinate y,
 
 // 1}}}
 
-// {{{1 split_quad
+// {{{1 tree_{alloc,free}
 
-static int split_quad(struct quad *quad)
+static void* tree_alloc(struct quad *quad, size_t size)
 {
-	assert(quad);
-	assert(quad->leaf);
+	if (quad->tree)
+		return arena_alloc(&quad->tree->arena, size);
+	return malloc(size);
+}
 
-	struct quad *children = malloc(sizeof(struct quad) * 4);
-	if (!children)
+static void tree_free(struct quad *quad, void *p, size_t size)
+{
+	if (quad->tree)
+		arena_free(&quad->tree->arena, p, size);
+	else
+		free(p);
+}
+
+/*
+ * Squares of NODE_BLOCK by NODE_BLOCK buckets take turns over the
+ * NUMA nodes, in Morton order.
+ */
+#define NODE_BLOCK 8
+
+/*
+ * Returns the node whose memory holds the bucket at bx, by.
+ */
+static unsigned node_of(const struct tree *tree, coordinate bx,
+                        coordinate by)
+{
+	if (tree->nodes <= 1)
 		return 0;
+	return morton(bx / NODE_BLOCK, by / NODE_BLOCK) % tree->nodes;
+}
 
-	struct bucket *cur = quad->items.head;
-	quad->leaf = 0;
-	quad->items.head = NULL;
-	quad->items.tail = NULL;
+/*
+ * Returns the node of the first bucket in quad, or -1 when it does
+ * not matter which worker steps it.
+ */
+static int quad_node(const struct quad *quad)
+{
+	if (!quad->tree || quad->tree->nodes <= 1)
+		return -1;
+
+	const struct quad *q = quad;
+	while(!q->leaf)
+		q = q->children[0];
+	if (q->items.head)
+		return node_of(quad->tree, q->items.head->x, q->items.head->y);
+	return node_of(quad->tree, quad->west, quad->north);
+}
 
-	for(unsigned i = 0; i < 4; ++i) {
-		quad->children[i] = children + i;
+static struct bucket* bucket_alloc(struct quad *leaf, coordinate bx,
+                                   coordinate by)
+{
+	if (leaf->tree)
+		return arena_alloc_on(&leaf->tree->arena,
+		                      node_of(leaf->tree, bx, by),
+		                      sizeof(struct bucket));
+	return malloc(sizeof(struct bucket));
+}
 
-		children[i].parent = quad;
-		children[i].leaf = 1;
-		children[i].count = 0;
-		children[i].items.head = NULL;
-		children[i].items.tail = NULL;
+static void bucket_free(struct quad *leaf, struct bucket *b)
+{
+	if (leaf->tree)
+		arena_free_on(&leaf->tree->arena, node_of(leaf->tree, b->x, b->y),
+		              b, sizeof(struct bucket));
+	else
+		free(b);
+}
+
+// 1}}}
+
+// {{{1 census
+
+/*
+ * Set on quads whose population and box have to be worked out again
+ * from the quads or buckets right below them. Every quad above a dirty
+ * one is dirty too.
+ */
+#define DIRTY 1
+/*
+ * Population of a bucket whose cells changed since it was measured.
+ */
+#define UNMEASURED 0xffff
+
+/*
+ * Marks quad and every quad above it dirty. Workers may do so at once.
+ */
+static void mark_dirty(struct quad *quad)
+{
+	for(; quad; quad = quad->parent) {
+		if (__atomic_fetch_or(&quad->dirty, DIRTY, __ATOMIC_RELAXED) & DIRTY)
+			break;
 	}
+}
 
+/*
+ * Counts the live cells of bucket, and finds the rectangle they are in.
+ */
+static void measure(struct bucket *bucket)
+{
+	unsigned population = 0;
+	unsigned north = 0, south = 0;
+	unsigned long long columns = 0;
+
+	const value *v = bucket->bucket;
+	for(unsigned iy = 0; iy < BUCKETSZ; ++iy) {
+		unsigned long long row = 0;
+		for(unsigned i = 0; i < BUCKETSZ / VALUE_BIT; ++i)
+			row |= (unsigned long long)*v++ << (i * VALUE_BIT);
+		if (!row)
+			continue;
+
+		if (!columns)
+			north = iy;
+		south = iy;
+		columns |= row;
+		population += __builtin_popcountll(row);
+	}
 
-	coordinate half = (quad->east - quad->west) / 2;
+	bucket->population = population;
+	bucket->box.west = columns ? __builtin_ctzll(columns) : 0;
+	bucket->box.east = columns ? 63 - __builtin_clzll(columns) : 0;
+	bucket->box.north = north;
+	bucket->box.south = south;
+}
 
-	coordinate hcenter = quad->east - half;
-	coordinate vcenter = quad->south - half;
+/*
+ * Grows the rectangle in offsets from a quad's top left cell by the
+ * one given, or starts it when population is still zero.
+ */
+static void enclose(coordinate box[4], uint64_t population,
+                    coordinate west, coordinate east,
+                    coordinate north, coordinate south)
+{
+	if (!population || west < box[0])
+		box[0] = west;
+	if (!population || east > box[1])
+		box[1] = east;
+	if (!population || north < box[2])
+		box[2] = north;
+	if (!population || south > box[3])
+		box[3] = south;
+}
 
-	quad->child_to.nw->west = quad->west;
-	quad->child_to.nw->east = hcenter;
-	quad->child_to.nw->north = quad->north;
-	quad->child_to.nw->south = vcenter;
+static void refresh(struct quad *quad)
+{
+	if (!quad->dirty)
+		return;
+	quad->dirty = 0;
 
-	quad->child_to.ne->west = hcenter;
-	quad->child_to.ne->east = quad->east;
-	quad->child_to.ne->north = quad->north;
-	quad->child_to.ne->south = vcenter;
+	// Offsets from the top left cell keep their order, wrapped or not.
+	coordinate ox = quad->west * BUCKETSZ;
+	coordinate oy = quad->north * BUCKETSZ;
 
-	quad->child_to.sw->west = quad->west;
-	quad->child_to.sw->east = hcenter;
-	quad->child_to.sw->north = vcenter;
+	uint64_t population = 0;
+	coordinate box[4] = { 0, 0, 0, 0 };
+	if (quad->leaf) {
+		for(struct bucket *b = quad->items.head; b; b = b->next) {
+			if (b->population == UNMEASURED)
+				measure(b);
+			if (!b->population)
+				continue;
+
+			coordinate x = b->x * BUCKETSZ - ox;
+			coordinate y = b->y * BUCKETSZ - oy;
+			enclose(box, population, x + b->box.west, x + b->box.east,
+			        y + b->box.north, y + b->box.south);
+			population += b->population;
+		}
+	} else {
+		for(unsigned i = 0; i < 4; ++i) {
+			struct quad *c = quad->children[i];
+			refresh(c);
+			if (!c->population)
+				continue;
+
+			enclose(box, population, c->box.west - ox, c->box.east - ox,
+			        c->box.north - oy, c->box.south - oy);
+			population += c->population;
+		}
+	}
+
+	quad->population = population;
+	quad->box.west = ox + box[0];
+	quad->box.east = ox + box[1];
+	quad->box.north = oy + box[2];
+	quad->box.south = oy + box[3];
+}
+
+void census(struct quad *quad)
+{
+	refresh(quad);
+}
+
+// 1}}}
+
+// {{{1 split_quad
+
+/*
+ * Makes the four quads in children empty leaves below quad, split
+ * at hcenter and vcenter.
+ */
+static void place_children(struct quad *quad, struct quad *children,
+                           coordinate hcenter, coordinate vcenter)
+{
+	quad->leaf = 0;
+
+	for(unsigned i = 0; i < 4; ++i) {
+		quad->children[i] = children + i;
+
+		children[i].parent = quad;
+		children[i].tree = quad->tree;
+		children[i].leaf = 1;
+		children[i].count = 0;
+		children[i].population = 0;
+		children[i].dirty = DIRTY;
+		children[i].items.head = NULL;
+		children[i].items.tail = NULL;
+	}
+	mark_dirty(quad);
+
+	quad->child_to.nw->west = quad->west;
+	quad->child_to.nw->east = hcenter;
+	quad->child_to.nw->north = quad->north;
+	quad->child_to.nw->south = vcenter;
+
+	quad->child_to.ne->west = hcenter;
+	quad->child_to.ne->east = quad->east;
+	quad->child_to.ne->north = quad->north;
+	quad->child_to.ne->south = vcenter;
+
+	quad->child_to.sw->west = quad->west;
+	quad->child_to.sw->east = hcenter;
+	quad->child_to.sw->north = vcenter;
 	quad->child_to.sw->south = quad->south;
 
 	quad->child_to.se->west = hcenter;
 	quad->child_to.se->east = quad->east;
 	quad->child_to.se->north = vcenter;
 	quad->child_to.se->south = quad->south;
+}
+
+static int split_quad(struct quad *quad)
+{
+	assert(quad);
+	assert(quad->leaf);
+
+	struct quad *children = tree_alloc(quad, sizeof(struct quad) * 4);
+	if (!children)
+		return 0;
+
+	struct bucket *cur = quad->items.head;
+
+	coordinate hcenter = (quad->west + span(quad->west, quad->east) / 2)
+	                   & BUCKET_MAX;
+	coordinate vcenter = (quad->north + span(quad->north, quad->south) / 2)
+	                   & BUCKET_MAX;
+	place_children(quad, children, hcenter, vcenter);
 
 	while(cur) {
 		struct bucket *add = cur;
@@ -243,6 +1125,205 @@ static int split_quad(struct quad *quad)
 	return 1;
 }
 
+/*
+ * Doubles the unbounded root until it holds the cell at x, y. The old
+ * root becomes the quadrant of the new one facing away from the cell.
+ *
+ * Returns zero when the root cannot grow any more, or out of memory.
+ */
+static int grow_root(struct quad *root, coordinate x, coordinate y)
+{
+	assert(!root->parent);
+
+	coordinate qx = x / BUCKETSZ;
+	coordinate qy = y / BUCKETSZ;
+
+	while(!is_in_quad(root, x, y)) {
+		coordinate width = span(root->west, root->east);
+		if (width > BUCKET_MAX / 4)
+			return 0;
+
+		struct quad *children = tree_alloc(root, sizeof(struct quad) * 4);
+		if (!children)
+			return 0;
+
+		int west  = span(qx, root->west) <= span(root->east, qx);
+		int north = span(qy, root->north) <= span(root->south, qy);
+
+		struct quad old = *root;
+
+		coordinate hcenter = west  ? root->west  : root->east;
+		coordinate vcenter = north ? root->north : root->south;
+		if (west)
+			root->west = (root->west - width) & BUCKET_MAX;
+		else
+			root->east = (root->east + width) & BUCKET_MAX;
+		if (north)
+			root->north = (root->north - width) & BUCKET_MAX;
+		else
+			root->south = (root->south + width) & BUCKET_MAX;
+
+		place_children(root, children, hcenter, vcenter);
+
+		struct quad *moved = children + (north ? 2 : 0) + (west ? 1 : 0);
+		moved->leaf = old.leaf;
+		moved->count = old.count;
+		if (old.leaf) {
+			moved->items = old.items;
+		} else {
+			for(unsigned i = 0; i < 4; ++i) {
+				moved->children[i] = old.children[i];
+				moved->children[i]->parent = moved;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// 1}}}
+
+// {{{1 merge_quad
+
+/*
+ * Moves the buckets in every leaf below quad to the end of leaf,
+ * deallocating the quads on the way.
+ */
+static void collect(struct quad *quad, struct quad *leaf)
+{
+	if (!quad->leaf) {
+		struct quad *children = quad->children[0];
+		for(unsigned i = 0; i < 4; ++i)
+			collect(quad->children[i], leaf);
+		tree_free(quad, children, sizeof(struct quad) * 4);
+		return;
+	}
+
+	struct bucket *cur = quad->items.head;
+	while(cur) {
+		struct bucket *add = cur;
+		cur = cur->next;
+
+		add->next = NULL;
+		add->prev = leaf->items.tail;
+		if (leaf->items.tail) {
+			leaf->items.tail->next = add;
+			add->num = add->prev->num+1;
+		} else {
+			leaf->items.head = add;
+			add->num = 0;
+		}
+		leaf->items.tail = add;
+	}
+}
+
+static void merge_quad(struct quad *quad)
+{
+	assert(quad);
+	assert(!quad->leaf);
+	assert(quad->count <= QUADMERGE);
+
+	struct quad *children[4];
+	for(unsigned i = 0; i < 4; ++i)
+		children[i] = quad->children[i];
+
+	quad->leaf = 1;
+	quad->items.head = NULL;
+	quad->items.tail = NULL;
+
+	for(unsigned i = 0; i < 4; ++i)
+		collect(children[i], quad);
+	tree_free(quad, children[0], sizeof(struct quad) * 4);
+	mark_dirty(quad);
+}
+
+// 1}}}
+
+// {{{1 neighbours
+
+/*
+ * Offsets to the neighbours of a bucket, in the order of
+ * union bucket_neighbours, and the index of the way back.
+ */
+static const struct { int x, y; } neighbour_delta[8] = {
+	{ -1,  0 }, // w
+	{ +1,  0 }, // e
+	{  0, -1 }, // n
+	{  0, +1 }, // s
+	{ -1, -1 }, // nw
+	{ +1, -1 }, // ne
+	{ -1, +1 }, // sw
+	{ +1, +1 }, // se
+};
+static const unsigned char neighbour_opposite[8] = {
+	1, 0, 3, 2, 7, 6, 5, 4,
+};
+
+static void link_bucket(struct quad *leaf, struct bucket *bucket)
+{
+	for(unsigned i = 0; i < 8; ++i) {
+		coordinate x = (bucket->x + neighbour_delta[i].x) * BUCKETSZ;
+		coordinate y = (bucket->y + neighbour_delta[i].y) * BUCKETSZ;
+		x = wrap(leaf->tree, x);
+		y = wrap(leaf->tree, y);
+
+		struct bucket *b = find_bucket(leaf, x, y, NULL);
+		bucket->neighbours.items[i] = b;
+		if (b)
+			b->neighbours.items[neighbour_opposite[i]] = bucket;
+	}
+}
+
+/*
+ * Returns how far from a changed cell the next step may feel it.
+ */
+static coordinate reach(struct tree *tree)
+{
+	return tree ? tree->stride : 1;
+}
+
+/*
+ * Marks bucket, and every neighbour within r cells of the cell at
+ * ix, iy, to be stepped.
+ */
+static void wake(struct bucket *bucket, coordinate ix, coordinate iy,
+                 coordinate r)
+{
+	const coordinate max = BUCKETSZ-1;
+
+	bucket->active = 1;
+
+	for(unsigned i = 0; i < 8; ++i) {
+		struct bucket *b = bucket->neighbours.items[i];
+		if (!b)
+			continue;
+
+		int dx = neighbour_delta[i].x;
+		int dy = neighbour_delta[i].y;
+		if ((dx < 0 && ix >= r) || (dx > 0 && ix + r <= max))
+			continue;
+		if ((dy < 0 && iy >= r) || (dy > 0 && iy + r <= max))
+			continue;
+
+		b->active = 1;
+	}
+}
+
+/*
+ * Removes the links to bucket. Its neighbours are woken, as they
+ * can no longer see what it touched in the last generation.
+ */
+static void unlink_bucket(struct bucket *bucket)
+{
+	for(unsigned i = 0; i < 8; ++i) {
+		struct bucket *b = bucket->neighbours.items[i];
+		if (b) {
+			b->neighbours.items[neighbour_opposite[i]] = NULL;
+			b->active = 1;
+		}
+	}
+}
+
 // 1}}}
 
 // {{{1 new_bucket
@@ -265,7 +1346,7 @@ static struct bucket* new_bucket(struct quad *quad, coordinate x, coordinate y,
 	if (leaf_quad)
 		*leaf_quad =  leaf;
 
-	struct bucket *new = malloc(sizeof(struct bucket));
+	struct bucket *new = bucket_alloc(leaf, x / BUCKETSZ, y / BUCKETSZ);
 	if (!new)
 		return NULL;
 	new->x = x / BUCKETSZ;
@@ -273,6 +1354,10 @@ static struct bucket* new_bucket(struct quad *quad, coordinate x, coordinate y,
 	assert(is_in_quad(leaf, new->x * BUCKETSZ, new->y * BUCKETSZ));
 
 	memset(new->bucket, 0, BUCKETSZ * BUCKETSZ / VALUE_BIT * sizeof(value));
+	memset(new->back, 0, BUCKETSZ * BUCKETSZ / VALUE_BIT * sizeof(value));
+	new->active = 1;
+	new->touched = 0;
+	new->population = UNMEASURED;
 
 	new->next = NULL;
 
@@ -294,6 +1379,9 @@ static struct bucket* new_bucket(struct quad *quad, coordinate x, coordinate y,
 		new->num = new->prev->num+1;
 	}
 
+	index_insert(leaf, new);
+	link_bucket(leaf, new);
+
 	return new;
 }
 
@@ -312,6 +1400,8 @@ value get(struct quad *quad, coordinate x, coordinate y)
 {
 	assert(quad);
 
+	x = wrap(quad->tree, x);
+	y = wrap(quad->tree, y);
 	struct bucket *current = find_bucket(quad, x, y, NULL);
 
 	if (!current)
@@ -322,41 +1412,47 @@ value get(struct quad *quad, coordinate x, coordinate y)
 	return index_bucket(current, ix, iy);
 }
 
-void set(struct quad *quad,
-                coordinate x, coordinate y, value v)
+/*
+ * Returns the bucket holding the cell at x, y, adding the bucket when
+ * there is none. Grows the root of an unbounded universe when the cell
+ * is outside of it. leaf_quad is set to the leaf of a new bucket, and
+ * left alone otherwise.
+ *
+ * Returns NULL when out of memory, or the root cannot grow.
+ */
+static struct bucket* obtain_bucket(struct quad *quad,
+                                    coordinate x, coordinate y,
+                                    struct quad **leaf_quad)
 {
-	assert(quad);
-
-	struct quad *leaf = NULL;
-	struct bucket *current = find_bucket(quad, x, y, &leaf);
+	struct bucket *current = find_bucket(quad, x, y, NULL);
+	if (current)
+		return current;
 
-	if (!current) {
-		assert(leaf);
-		if (v)
-			current = new_bucket(leaf, x, y, &leaf);
-		else
-			return;
+	struct quad *leaf = find_quad(quad, x, y);
+	if (!leaf) {
+		// Outside of an unbounded universe: grow the root.
+		struct quad *root = quad;
+		while(root->parent)
+			root = root->parent;
 
-		if (!current) // TODO: Do better?
-			return;
+		if (root->tree && root->tree->torus)
+			return NULL;
+		if (!grow_root(root, x, y))
+			return NULL;
+		leaf = find_quad(root, x, y);
 	}
 
-	coordinate ix = x - current->x * BUCKETSZ;
-	coordinate iy = y - current->y * BUCKETSZ;
-	coordinate i = ix + iy * BUCKETSZ;
-	if (v)
-		current->bucket[i / VALUE_BIT] |= (1 << (i % VALUE_BIT));
-	else
-		current->bucket[i / VALUE_BIT] &= ~(1 << (i % VALUE_BIT));
-
-	// "Garbage collection": Check if a bucket contains only dead cells.
-	if (v) return;
-
-	for(unsigned j = 0; j < BUCKETSZ * BUCKETSZ / VALUE_BIT; ++j) {
-		if (current->bucket[j])
-			return;
-	}
+	return new_bucket(leaf, x, y, leaf_quad);
+}
 
+/*
+ * "Garbage collection": removes bucket, which holds only dead cells,
+ * from leaf and merges the largest subtree that became small enough.
+ *
+ * Returns the quad now covering the bucket's area.
+ */
+static struct quad* delete_bucket(struct quad *leaf, struct bucket *current)
+{
 	if (current->next) {
 		current->next->prev = current->prev;
 	} else {
@@ -372,552 +1468,1759 @@ void set(struct quad *quad,
 			leaf->items.head->prev = NULL;
 	}
 
-	free(current);
-
-	while(leaf) {
-		leaf->count--;
-		leaf = leaf->parent;
-	}
-}
-
-// 1}}}
-
-/* {{{1 update */
+	unlink_bucket(current);
+	index_remove(leaf->tree, current);
+	bucket_free(leaf, current);
+	mark_dirty(leaf);
 
-void update(struct conway *cw)
-{
-	cw->generation++;
-	for(unsigned i = 0; i < cw->changes.length; ++i) {
-		struct state_change c = cw->changes.items[i];
-		set(cw->root, c.x, c.y, c.v);
+	struct quad *merge = NULL;
+	for(struct quad *cur = leaf; cur; cur = cur->parent) {
+		cur->count--;
+		if (!cur->leaf && cur->count <= QUADMERGE)
+			merge = cur;
 	}
-}
-
-union bucket_neighbours
-{
-	struct {
-		struct bucket *w,  *e,  *n,  *s,
-		              *nw, *ne, *sw, *se;
-	};
-	struct bucket *items[8];
-};
-
-union neighbor_coordinates { 
-	struct { coordinate x, y; } items[8];
-	struct {
-		struct { coordinate x, y; } w;
-		struct { coordinate x, y; } e;
-		struct { coordinate x, y; } n;
-		struct { coordinate x, y; } s;
-		struct { coordinate x, y; } nw;
-		struct { coordinate x, y; } ne;
-		struct { coordinate x, y; } sw;
-		struct { coordinate x, y; } se;
-	};
-};
 
-static void cell(struct state_change_buffer* changes,
-                 unsigned n,
-                 coordinate x, coordinate y, value v)
-{
-	if (v) {
-		switch(n) {
-		 case 0:
-		 case 1: // Starvation
-			append(changes, x, y, 0);
-			return;
-		 case 2:
-		 case 3: // No change
-		 	return;
-		default: // Overpopulation
-			append(changes, x, y, 0);
-			return;
-		}
-	} else if (n == 3) {
-		append(changes, x, y, 1);
-	} 
+	if (!merge)
+		return leaf;
+	merge_quad(merge);
+	return merge;
 }
 
-enum bucket_edge {
-	EDGE_NORTH = (1<<0),
-	EDGE_SOUTH = (1<<1),
-	EDGE_EAST  = (1<<2),
-	EDGE_WEST  = (1<<3),
-};
-
-static void corner_step(struct state_change_buffer *changes,
-                        union bucket_neighbours *neighbour,
-                        struct bucket *bucket, coordinate xp, coordinate yp,
-                        enum bucket_edge edge)
+void set(struct quad *quad,
+                coordinate x, coordinate y, value v)
 {
-	union bucket_neighbours n = *neighbour;
+	assert(quad);
 
-	coordinate x, y;
+	x = wrap(quad->tree, x);
+	y = wrap(quad->tree, y);
 
-	coordinate max = BUCKETSZ-1;
-
-	switch(edge) {
-	case EDGE_NORTH|EDGE_WEST: // NE
-		x = 0; y = 0;
-		break;
-	case EDGE_NORTH|EDGE_EAST: // NW
-		x = max; y = 0;
-		break;
-	case EDGE_SOUTH|EDGE_WEST: // SW
-		x = 0; y = max;
-		break;
-	case EDGE_SOUTH|EDGE_EAST: // SE
-		x = max; y = max;
-		break;
-	}
-
-	struct { int x, y; } delta[8] = {
-		{ -1,  0 }, // w
-		{ +1,  0 }, // e
-		{  0, -1 }, // n
-		{  0, +1 }, // s
-		{ -1, -1 }, // nw
-		{ +1, -1 }, // ne
-		{ -1, +1 }, // sw
-		{ +1, +1 }, // se
-	};
+	struct quad *leaf = quad;
+	struct bucket *current = v ? obtain_bucket(quad, x, y, &leaf)
+	                           : find_bucket(quad, x, y, NULL);
+	if (!current) // TODO: Do better?
+		return;
 
-	union neighbor_coordinates coord;
+	coordinate ix = x - current->x * BUCKETSZ;
+	coordinate iy = y - current->y * BUCKETSZ;
+	coordinate i = ix + iy * BUCKETSZ;
+	value was = current->bucket[i / VALUE_BIT];
+	if (v)
+		current->bucket[i / VALUE_BIT] |= (1 << (i % VALUE_BIT));
+	else
+		current->bucket[i / VALUE_BIT] &= ~(1 << (i % VALUE_BIT));
 
-	for(unsigned i = 0; i < 8; ++i) {
-		coord.items[i].x = x + delta[i].x;
-		coord.items[i].y = y + delta[i].y;
+	if (current->bucket[i / VALUE_BIT] != was) {
+		wake(current, ix, iy, reach(quad->tree));
+		current->population = UNMEASURED;
+		mark_dirty(find_quad(leaf, x, y));
 	}
 
-	for(unsigned i = 0; i < 8; ++i)
-		n.items[i] = bucket;
+	if (v) return;
 
+	for(unsigned j = 0; j < BUCKETSZ * BUCKETSZ / VALUE_BIT; ++j) {
+		if (current->bucket[j])
+			return;
+	}
 
-	switch(edge) {
-	case EDGE_NORTH|EDGE_WEST: // NE
-		n.n  = neighbour->n;
-		coord.n.x = 0;
-		coord.n.y = max;
+	delete_bucket(find_quad(leaf, x, y), current);
+}
 
-		n.ne = neighbour->n;
-		coord.ne.x = 1;
-		coord.ne.y = max;
+// 1}}}
 
-		n.nw = neighbour->nw;
-		coord.nw.x = max;
-		coord.nw.y = max;
+/* {{{1 update */
 
-		n.w  = neighbour->w;
-		coord.w.x = max;
-		coord.w.y = 0;
+// {{{1 halo
 
-		n.sw = neighbour->w;
-		coord.sw.x = max;
-		coord.sw.y = 1;
+static bucket_row load_row(const value *v, coordinate iy)
+{
+	v += iy * (BUCKETSZ / VALUE_BIT);
 
-		break;
-	case EDGE_NORTH|EDGE_EAST: // NW
-		n.n  = neighbour->n;
-		coord.n.x = max;
-		coord.n.y = max;
+	bucket_row r = 0;
+	for(unsigned i = 0; i < BUCKETSZ / VALUE_BIT; ++i)
+		r |= (bucket_row)v[i] << (i * VALUE_BIT);
+	return r;
+}
 
-		n.ne = neighbour->ne;
-		coord.ne.x = 0;
-		coord.ne.y = max;
+static void store_row(value *v, coordinate iy, bucket_row r)
+{
+	v += iy * (BUCKETSZ / VALUE_BIT);
 
-		n.nw = neighbour->n;
-		coord.nw.x = max-1;
-		coord.nw.y = max;
+	for(unsigned i = 0; i < BUCKETSZ / VALUE_BIT; ++i)
+		v[i] = r >> (i * VALUE_BIT);
+}
 
-		n.e  = neighbour->e;
-		coord.e.x = 0;
-		coord.e.y = 0;
-		n.se = neighbour->e;
-		coord.se.x = 0;
-		coord.se.y = 1;
+static bucket_row row_cells(const value *cells, coordinate iy)
+{
+	if (!cells)
+		return 0;
 
-		break;
-	case EDGE_SOUTH|EDGE_WEST: // SW
-		n.s  = neighbour->s;
-		coord.s.x = 0;
-		coord.s.y = 0;
+	return load_row(cells, iy);
+}
 
-		n.se = neighbour->s;
-		coord.se.x = 1;
-		coord.se.y = 0;
+static bucket_row column_cells(const value *cells, coordinate ix,
+                               coordinate iy, unsigned shift)
+{
+	if (!cells)
+		return 0;
 
-		n.sw = neighbour->sw;
-		coord.sw.x = max;
-		coord.sw.y = 0;
+	coordinate i = ix + iy * BUCKETSZ;
+	return (bucket_row)((cells[i / VALUE_BIT] >> (i % VALUE_BIT)) & 1)
+	       << shift;
+}
 
-		n.w  = neighbour->w;
-		coord.w.x = max;
-		coord.w.y = max;
+/*
+ * Loads the halo of the cells of a bucket, given the cells of its
+ * neighbours in the order of union bucket_neighbours. Any of them may
+ * be NULL when empty.
+ */
+static void load_halo_cells(struct halo *h, const value *cells,
+                            const value *const *n)
+{
+	BUILD_BUG_ON(sizeof(bucket_row) * 8 != BUCKETSZ); // A row of a bucket must fill a bucket_row exactly.
 
-		n.nw = neighbour->w;
-		coord.nw.x = max;
-		coord.nw.y = max-1;
+	const coordinate max = BUCKETSZ-1;
+	const value *w = n[0], *e = n[1], *no = n[2], *so = n[3],
+	            *nw = n[4], *ne = n[5], *sw = n[6], *se = n[7];
 
-		break;
-	case EDGE_SOUTH|EDGE_EAST: // SE
-		n.s  = neighbour->s;
-		coord.s.x = max;
-		coord.s.y = 0;
+	h->rows[0] = row_cells(no, max);
+	h->west[0] = column_cells(nw, max, max, 0);
+	h->east[0] = column_cells(ne, 0, max, max);
 
-		n.se = neighbour->se;
-		coord.se.x = 0;
-		coord.se.y = 0;
+	for(coordinate y = 0; y < BUCKETSZ; ++y) {
+		h->rows[y+1] = row_cells(cells, y);
+		h->west[y+1] = column_cells(w, max, y, 0);
+		h->east[y+1] = column_cells(e, 0, y, max);
+	}
 
-		n.sw = neighbour->s;
-		coord.sw.x = max-1;
-		coord.sw.y = 0;
+	h->rows[BUCKETSZ+1] = row_cells(so, 0);
+	h->west[BUCKETSZ+1] = column_cells(sw, max, 0, 0);
+	h->east[BUCKETSZ+1] = column_cells(se, 0, 0, max);
+}
 
-		n.e  = neighbour->e;
-		coord.e.x = 0;
-		coord.e.y = max;
+static void load_halo(struct halo *h, struct bucket *bucket,
+                      union bucket_neighbours *n)
+{
+	const value *cells[8];
+	for(unsigned i = 0; i < 8; ++i)
+		cells[i] = n->items[i] ? n->items[i]->bucket : NULL;
 
-		n.ne = neighbour->e;
-		coord.ne.x = 0;
-		coord.ne.y = max-1;
+	load_halo_cells(h, bucket ? bucket->bucket : NULL, cells);
+}
 
-		break;
+/*
+ * Records the rows of cells born and died in the bucket at x, y, if
+ * there are any. died may be NULL when none did.
+ */
+static void emit(struct state_change_buffer *changes,
+                 coordinate x, coordinate y,
+                 const bucket_row *born, const bucket_row *died)
+{
+	struct bucket_change c;
+	c.x = x;
+	c.y = y;
+
+	bucket_row any = 0;
+	for(coordinate iy = 0; iy < BUCKETSZ; ++iy) {
+		store_row(c.born, iy, born[iy]);
+		store_row(c.died, iy, died ? died[iy] : 0);
+		any |= born[iy] | (died ? died[iy] : 0);
 	}
 
+	if (any && !append_bucket(changes, &c))
+		fail_step(changes);
+}
 
-	unsigned c = 0;
-
-	unsigned coordsz = sizeof(coord.items)/sizeof(coord.items[0]);
+// 1}}}
 
-	for(unsigned j = 0; j < coordsz; ++j) {
-		if (!n.items[j]) continue;
+// {{{1 apply
 
-		c += index_bucket(n.items[j],
-			          coord.items[j].x,
-			          coord.items[j].y);
+/*
+ * Marks bucket, and every neighbour within r cells of a cell set in
+ * diff, to be stepped.
+ */
+static void wake_rows(struct bucket *bucket, const bucket_row *diff,
+                      coordinate r)
+{
+	bucket_row cols = 0;
+	for(unsigned y = 0; y < BUCKETSZ; ++y)
+		cols |= diff[y];
+	if (!cols)
+		return;
+
+	__atomic_store_n(&bucket->active, 1, __ATOMIC_RELAXED);
+
+	bucket_row top = 0, bottom = 0;
+	for(unsigned y = 0; y < r && y < BUCKETSZ; ++y) {
+		top |= diff[y];
+		bottom |= diff[BUCKETSZ-1 - y];
 	}
 
-	value v = bucket && index_bucket(bucket, x, y);
+	const bucket_row west = r < BUCKETSZ ? ((bucket_row)1 << r) - 1
+	                                     : ~(bucket_row)0;
+	const bucket_row east = r < BUCKETSZ ? west << (BUCKETSZ - r)
+	                                     : ~(bucket_row)0;
+	const int borders[8] = {
+		(cols & west) != 0, (cols & east) != 0, top != 0, bottom != 0,
+		(top & west) != 0,  (top & east) != 0,
+		(bottom & west) != 0, (bottom & east) != 0,
+	};
+	// Parts of a parallel update may wake the same neighbour at once.
+	for(unsigned i = 0; i < 8; ++i) {
+		struct bucket *b = bucket->neighbours.items[i];
+		if (b && borders[i])
+			__atomic_store_n(&b->active, 1, __ATOMIC_RELAXED);
+	}
+}
 
-	cell(changes, c, xp+x, yp+y, v);
+static value has_births(const struct bucket_change *c)
+{
+	value births = 0;
+	for(unsigned i = 0; i < BUCKETSZ * BUCKETSZ / VALUE_BIT; ++i)
+		births |= c->born[i];
+	return births;
 }
 
-static void edge_step(struct state_change_buffer *changes,
-                      union bucket_neighbours *neighbour,
-                      struct bucket *bucket, coordinate xp, coordinate yp,
-                      enum bucket_edge edge)
+/*
+ * Applies the births and deaths in c to the cells of b, and wakes
+ * the buckets that have to see them. Sets *changed when a cell did.
+ *
+ * Returns non-zero when b has live cells left.
+ */
+static bucket_row apply_cells(struct tree *tree, struct bucket *b,
+                              const struct bucket_change *c,
+                              bucket_row *changed)
 {
-	union bucket_neighbours n = *neighbour;
+	bucket_row diff[BUCKETSZ];
+	bucket_row live = 0;
+	*changed = 0;
+	for(unsigned iy = 0; iy < BUCKETSZ; ++iy) {
+		bucket_row was = load_row(b->bucket, iy);
+		bucket_row is = (was | load_row(c->born, iy))
+		              & ~load_row(c->died, iy);
+
+		diff[iy] = was ^ is;
+		if (diff[iy])
+			store_row(b->bucket, iy, is);
+		live |= is;
+		*changed |= diff[iy];
+	}
 
-	for(unsigned i = 0; i < 8; ++i)
-		n.items[i] = bucket;
-
-	switch(edge) {
-	case EDGE_NORTH:
-		n.n  = neighbour->n;
-		n.ne = neighbour->n;
-		n.nw = neighbour->n;
-		break;
-	case EDGE_SOUTH:
-		n.s  = neighbour->s;
-		n.se = neighbour->s;
-		n.sw = neighbour->s;
-		break;
-	case EDGE_EAST:
-		n.e  = neighbour->e;
-		n.ne = neighbour->e;
-		n.se = neighbour->e;
-		break;
-	case EDGE_WEST:
-		n.w  = neighbour->w;
-		n.nw = neighbour->w;
-		n.sw = neighbour->w;
-		break;
-	}
-
-	for (coordinate i = 1; i < BUCKETSZ-1; ++i) {
+	wake_rows(b, diff, reach(tree));
+	return live;
+}
 
-		coordinate x, y;
+/*
+ * Applies the births and deaths in one bucket change at once, adding
+ * the bucket or collecting it as needed. The search for it starts
+ * from hint.
+ *
+ * Returns the quad to start the search for the next bucket from, or
+ * NULL when the bucket cannot be added.
+ */
+static struct quad* apply(struct quad *hint, const struct bucket_change *c)
+{
+	coordinate x = c->x * BUCKETSZ;
+	coordinate y = c->y * BUCKETSZ;
+
+	int births = has_births(c);
+	struct quad *leaf = hint;
+	struct bucket *b = births ? obtain_bucket(hint, x, y, &leaf)
+	                          : find_bucket(hint, x, y, NULL);
+	if (!b) // Deaths in a bucket that is not there change nothing.
+		return births ? NULL : leaf;
+
+	bucket_row changed;
+	bucket_row live = apply_cells(hint->tree, b, c, &changed);
+	if (live && !changed)
+		return leaf;
+
+	leaf = find_quad(leaf, x, y);
+	if (!live)
+		return delete_bucket(leaf, b);
+
+	b->population = UNMEASURED;
+	mark_dirty(leaf);
+	return leaf;
+}
 
-		switch(edge) {
-		case EDGE_NORTH:
-			x = i; y = 0;
-			break;
-		case EDGE_SOUTH:
-			x = i; y = BUCKETSZ-1;
-			break;
-		case EDGE_WEST:
-			x = 0; y = i;
-			break;
-		case EDGE_EAST:
-			x = BUCKETSZ-1; y = i;
-			break;
-		}
+/*
+ * Gathers the single cell changes items[order[*i]] on, or items[*i] on
+ * when order is NULL, up to length, into run for as long as they fall
+ * in the same bucket. Moves *i past them.
+ */
+static void make_run(struct tree *tree, const struct state_change *items,
+                     const unsigned *order, unsigned length, unsigned *i,
+                     struct bucket_change *run)
+{
+	const struct state_change *c = items + (order ? order[*i] : *i);
 
+	memset(run, 0, sizeof(*run));
+	run->x = wrap(tree, c->x) / BUCKETSZ;
+	run->y = wrap(tree, c->y) / BUCKETSZ;
 
-		union neighbor_coordinates coord = {
-			{
-				{ x-1, y+0 }, // w
-				{ x+1, y+0 }, // e
-				{ x+0, y-1 }, // n
-				{ x+0, y+1 }, // s
-				{ x-1, y-1 }, // nw
-				{ x+1, y-1 }, // ne
-				{ x-1, y+1 }, // sw
-				{ x+1, y+1 }, // se
-			},
-		};
-
-		switch(edge) {
-		case EDGE_NORTH:
-			coord.n.y  = BUCKETSZ-1;
-			coord.nw.y = BUCKETSZ-1;
-			coord.ne.y = BUCKETSZ-1;
-			break;
-		case EDGE_SOUTH:
-			coord.s.y  = 0;
-			coord.sw.y = 0;
-			coord.se.y = 0;
-			break;
-			
-		case EDGE_WEST:
-			coord.w.x  = BUCKETSZ-1;
-			coord.nw.x = BUCKETSZ-1;
-			coord.sw.x = BUCKETSZ-1;
+	for(; *i < length; ++*i) {
+		c = items + (order ? order[*i] : *i);
+		coordinate x = wrap(tree, c->x);
+		coordinate y = wrap(tree, c->y);
+		if (x / BUCKETSZ != run->x || y / BUCKETSZ != run->y)
 			break;
 
-		case EDGE_EAST:
-			coord.e.x  = 0;
-			coord.ne.x = 0;
-			coord.se.x = 0;
-			break;
+		// The last change to a cell wins, as with set().
+		coordinate j = x % BUCKETSZ + y % BUCKETSZ * BUCKETSZ;
+		value bit = 1 << (j % VALUE_BIT);
+		if (c->v) {
+			run->born[j / VALUE_BIT] |= bit;
+			run->died[j / VALUE_BIT] &= ~bit;
+		} else {
+			run->died[j / VALUE_BIT] |= bit;
+			run->born[j / VALUE_BIT] &= ~bit;
 		}
+	}
+}
 
-		unsigned c = 0;
+/*
+ * Applies the changes a bucket at a time: consecutive single cell
+ * changes to the same bucket are gathered into one bucket change.
+ *
+ * Returns zero when a bucket cannot be added, leaving the changes
+ * after it unapplied.
+ */
+static int apply_changes(struct conway *cw)
+{
+	struct tree *tree = cw->root->tree;
+	struct quad *hint = cw->root;
 
-		unsigned coordsz = sizeof(coord.items)/sizeof(coord.items[0]);
+	for(unsigned i = 0; hint && i < cw->changes.buckets_length; ++i)
+		hint = apply(hint, cw->changes.buckets + i);
 
-		for(unsigned j = 0; j < coordsz; ++j) {
-			if (!n.items[j]) continue;
+	for(unsigned i = 0; hint && i < cw->changes.length; ) {
+		struct bucket_change run;
+		make_run(tree, cw->changes.items, NULL, cw->changes.length, &i,
+		         &run);
+		hint = apply(hint, &run);
+	}
+	return hint != NULL;
+}
 
-			c += index_bucket(n.items[j],
-			                  coord.items[j].x,
-			                  coord.items[j].y);
-		}
+/*
+ * Fewest changes worth splitting between the workers.
+ */
+#ifndef PARALLEL_MIN
+#define PARALLEL_MIN 256
+#endif
+/*
+ * The changes of a parallel update are split by the subtrees at most
+ * PART_LEVELS below the root, aiming for PARTS_PER_WORKER of them for
+ * each worker.
+ */
+#define PART_LEVELS 5
+#define PARTS_PER_WORKER 4
+
+/*
+ * The bucket changes and single cell changes of cw that fall in one
+ * subtree, by their index.
+ */
+struct part {
+	struct conway *cw;
+	unsigned *buckets, *items;
+	unsigned buckets_length, items_length;
+	/*
+	 * Non-zero once a worker was given the part, and once applying
+	 * it ran out of memory.
+	 */
+	int queued, failed;
+};
 
-		value v = bucket && index_bucket(bucket, x, y);
-		cell(changes, c, xp+x, yp+y, v);
+/*
+ * Returns the part of the cell at x, y: the path to it from root down
+ * levels quads, two bits a level, a leaf standing in for every part
+ * below it.
+ */
+static unsigned part_of(struct quad *root, coordinate x, coordinate y,
+                        unsigned levels)
+{
+	unsigned part = 0;
+	struct quad *q = root;
+	for(unsigned l = 0; l < levels; ++l) {
+		unsigned i = 0;
+		if (!q->leaf) {
+			while(i < 3 && !is_in_quad(q->children[i], x, y))
+				++i;
+			q = q->children[i];
+		}
+		part = part << 2 | i;
 	}
+	return part;
 }
 
-static void bucket_step(struct quad *now,
-                        struct bucket *bucket,
-                        union bucket_neighbours *neighbours,
-                        struct state_change_buffer *changes)
+/*
+ * Applies c when its bucket is there already and keeps live cells.
+ * Adding and collecting buckets changes the tree, which the parts
+ * share, so those changes are deferred to apply() instead.
+ *
+ * Returns the quad to start the search for the next bucket from, or
+ * NULL when c cannot be deferred.
+ */
+static struct quad* apply_existing(struct quad *hint,
+                                   const struct bucket_change *c,
+                                   struct state_change_buffer *deferred)
+{
+	coordinate x = c->x * BUCKETSZ;
+	coordinate y = c->y * BUCKETSZ;
+
+	// Deaths too, in case an earlier change deferred adding it.
+	struct bucket *b = find_bucket(hint, x, y, NULL);
+	if (!b)
+		return push_bucket(deferred, c) ? hint : NULL;
+
+	bucket_row changed;
+	bucket_row live = apply_cells(hint->tree, b, c, &changed);
+	if (!live) {
+		// apply() collects it, unless a later change brings it back.
+		struct bucket_change none;
+		memset(&none, 0, sizeof(none));
+		none.x = c->x;
+		none.y = c->y;
+		return push_bucket(deferred, &none) ? hint : NULL;
+	}
+	if (!changed)
+		return hint;
+
+	struct quad *leaf = find_quad(hint, x, y);
+	b->population = UNMEASURED;
+	mark_dirty(leaf);
+	return leaf;
+}
+
+/*
+ * Applies the changes of part, deferring those that add or collect a
+ * bucket to deferred. With deferred NULL, applies all of them.
+ *
+ * Returns zero when out of memory, leaving the rest of part unapplied.
+ */
+static int apply_part(struct part *part,
+                      struct state_change_buffer *deferred)
+{
+	struct conway *cw = part->cw;
+	struct tree *tree = cw->root->tree;
+	struct quad *hint = cw->root;
+
+	for(unsigned i = 0; hint && i < part->buckets_length; ++i) {
+		const struct bucket_change *c = cw->changes.buckets
+		                              + part->buckets[i];
+		hint = deferred ? apply_existing(hint, c, deferred)
+		                : apply(hint, c);
+	}
+
+	for(unsigned i = 0; hint && i < part->items_length; ) {
+		struct bucket_change run;
+		make_run(tree, cw->changes.items, part->items, part->items_length,
+		         &i, &run);
+		hint = deferred ? apply_existing(hint, &run, deferred)
+		                : apply(hint, &run);
+	}
+	return hint != NULL;
+}
+
+static void run_part(void *p, int run)
+{
+	struct part *part = p;
+	if (!run)
+		return;
+
+	struct change_segments *seg = part->cw->changes.opaque;
+	part->failed = !apply_part(part, seg->items + workq_self());
+}
+
+/*
+ * Applies the changes of cw split by subtree between the workers of
+ * queue, each of which has a segment to defer changes to. The changes
+ * deferred are then applied here, in the order they were deferred.
+ * Without the memory to split them, applies them all here instead.
+ *
+ * Returns zero when out of memory, with some changes unapplied.
+ */
+static int apply_parts(struct conway *cw, struct workq *queue,
+                       unsigned workers)
+{
+	struct tree *tree = cw->root->tree;
+	struct change_segments *seg = cw->changes.opaque;
+
+	unsigned levels = 1;
+	while(levels < PART_LEVELS
+	   && (1u << 2 * levels) < workers * PARTS_PER_WORKER)
+		++levels;
+	unsigned parts = 1u << 2 * levels;
+
+	unsigned buckets = cw->changes.buckets_length;
+	unsigned length = buckets + cw->changes.length;
+	unsigned *of = malloc(sizeof(unsigned) * length);
+	unsigned *order = malloc(sizeof(unsigned) * length);
+	struct part *p = calloc(parts, sizeof(struct part));
+	if (!of || !order || !p) {
+		free(of);
+		free(order);
+		free(p);
+		return apply_changes(cw);
+	}
+
+	// Sort the changes by part, keeping their order within each.
+	for(unsigned i = 0; i < length; ++i) {
+		coordinate x, y;
+		if (i < buckets) {
+			x = cw->changes.buckets[i].x * BUCKETSZ;
+			y = cw->changes.buckets[i].y * BUCKETSZ;
+		} else {
+			x = wrap(tree, cw->changes.items[i - buckets].x);
+			y = wrap(tree, cw->changes.items[i - buckets].y);
+		}
+		of[i] = part_of(cw->root, x, y, levels);
+		if (i < buckets)
+			p[of[i]].buckets_length++;
+		else
+			p[of[i]].items_length++;
+	}
+
+	unsigned *next = order;
+	for(unsigned j = 0; j < parts; ++j) {
+		p[j].buckets = next;
+		next += p[j].buckets_length;
+		p[j].buckets_length = 0;
+	}
+	for(unsigned j = 0; j < parts; ++j) {
+		p[j].items = next;
+		next += p[j].items_length;
+		p[j].items_length = 0;
+	}
+	for(unsigned i = 0; i < length; ++i) {
+		struct part *q = p + of[i];
+		if (i < buckets)
+			q->buckets[q->buckets_length++] = i;
+		else
+			q->items[q->items_length++] = i - buckets;
+	}
+	free(of);
+
+	for(unsigned j = 0; j < parts; ++j) {
+		p[j].cw = cw;
+		if (p[j].buckets_length || p[j].items_length)
+			p[j].queued = workq_add(queue, p + j, run_part);
+	}
+	workq_wait(queue);
+
+	// Parts no worker could be given are disjoint from the rest.
+	int ok = 1;
+	for(unsigned j = 0; j < parts; ++j) {
+		if (p[j].queued)
+			ok = ok && !p[j].failed;
+		else
+			ok = ok && apply_part(p + j, NULL);
+	}
+
+	struct quad *hint = cw->root;
+	for(unsigned i = 0; i < seg->length; ++i) {
+		struct state_change_buffer *s = seg->items + i;
+		for(unsigned k = 0; ok && k < s->buckets_length; ++k) {
+			hint = apply(hint, s->buckets + k);
+			ok = hint != NULL;
+		}
+		s->buckets_length = 0;
+	}
+
+	free(order);
+	free(p);
+	return ok;
+}
+
+int update(struct conway *cw)
+{
+	cw->generation += cw->stride;
+	if (cw->rule.born & 1)
+		cw->phase = !cw->phase || (cw->rule.survive & (1 << 8));
+
+	return apply_changes(cw);
+}
+
+int conway_update(struct conway *cw, void *queue)
+{
+	cw->generation += cw->stride;
+	if (cw->rule.born & 1)
+		cw->phase = !cw->phase || (cw->rule.survive & (1 << 8));
+
+	unsigned workers = queue ? workq_workers(queue) : 0;
+	if (workers > 1
+	 && cw->changes.buckets_length + cw->changes.length >= PARALLEL_MIN) {
+		struct change_segments *seg = cw->changes.opaque;
+		reserve_segments(&cw->changes, workers);
+		if (seg->length >= workers)
+			return apply_parts(cw, queue, workers);
+	}
+
+	return apply_changes(cw);
+}
+
+struct quad* set_bucket(struct quad *hint, coordinate bx, coordinate by,
+                        const value *cells)
+{
+	struct bucket_change c;
+	c.x = bx;
+	c.y = by;
+	for(unsigned i = 0; i < BUCKETSZ * BUCKETSZ / VALUE_BIT; ++i) {
+		c.born[i] = cells[i];
+		c.died[i] = ~cells[i];
+	}
+	return apply(hint, &c);
+}
+
+// 1}}}
+
+/*
+ * Steps an empty neighbour, described by n, emitting births for the
+ * cells selected by mask in rows first to last.
+ */
+static void ghost_step(struct state_change_buffer *changes,
+                       struct tree *tree, union bucket_neighbours *n,
+                       coordinate xp, coordinate yp,
+                       coordinate first, coordinate last, bucket_row mask)
+{
+	xp = wrap(tree, xp);
+	yp = wrap(tree, yp);
+
+	struct halo h;
+	load_halo(&h, NULL, n);
+
+	bucket_row next[BUCKETSZ];
+	kernel_step(&tree->rule, &h, next);
+
+	bucket_row born[BUCKETSZ] = { 0 };
+	for(coordinate y = first; y <= last; ++y)
+		born[y] = next[y] & mask;
+	emit(changes, xp / BUCKETSZ, yp / BUCKETSZ, born, NULL);
+}
+
+/*
+ * Steps a bucket, recording every cell that changes. When back is
+ * non-NULL, the next generation of the bucket is written there
+ * instead, and only births in missing neighbours are recorded.
+ *
+ * Returns non-zero when the next generation came from the memo.
+ */
+static int bucket_step(struct tree *tree, struct bucket *bucket,
+                        union bucket_neighbours *neighbours,
+                        struct state_change_buffer *changes,
+                        value *back)
 {
+	const coordinate max = BUCKETSZ-1;
+
 	coordinate xp = bucket->x * BUCKETSZ;
 	coordinate yp = bucket->y * BUCKETSZ;
 
-	edge_step(changes, neighbours, bucket, xp, yp, EDGE_NORTH);
-	edge_step(changes, neighbours, bucket, xp, yp, EDGE_SOUTH);
-	edge_step(changes, neighbours, bucket, xp, yp, EDGE_WEST);
-	edge_step(changes, neighbours, bucket, xp, yp, EDGE_EAST);
+	struct halo h;
+	load_halo(&h, bucket, neighbours);
+
+	bucket_row next[BUCKETSZ];
+	int remembered = memo_step(tree->memo, &tree->rule, &h, next);
+
+	bucket_row cols = 0;
+	bucket_row born[BUCKETSZ], died[BUCKETSZ];
 
-	corner_step(changes, neighbours, bucket, xp, yp, EDGE_NORTH|EDGE_WEST);
-	corner_step(changes, neighbours, bucket, xp, yp, EDGE_NORTH|EDGE_EAST);
-	corner_step(changes, neighbours, bucket, xp, yp, EDGE_SOUTH|EDGE_WEST);
-	corner_step(changes, neighbours, bucket, xp, yp, EDGE_SOUTH|EDGE_EAST);
+	for(coordinate y = 0; y < BUCKETSZ; ++y) {
+		bucket_row cur = h.rows[y+1];
 
-	if (!neighbours->n) {
-		yp -= BUCKETSZ;
+		if (back) {
+			store_row(back, y, next[y]);
+		} else {
+			born[y] = next[y] & ~cur;
+			died[y] = cur & ~next[y];
+		}
 
-                union bucket_neighbours mn;
+		cols |= cur;
+	}
+	if (!back)
+		emit(changes, bucket->x, bucket->y, born, died);
+
+	/*
+	 * Cells may be born in neighbours that do not exist yet.
+	 * Those next to an empty edge of this bucket are covered by
+	 * whichever other neighbour they touch, if any. Under B1 they
+	 * may only touch one cell, and the corners of the bucket may
+	 * give birth diagonally too.
+	 */
+	const int b1 = tree->rule.born & 2;
+	const bucket_row all = ~(bucket_row)0;
+
+	if (!neighbours->n && (b1 || h.rows[1])) {
+		union bucket_neighbours mn = { 0 };
 		mn.s  = bucket;
 		mn.w  = neighbours->nw;
 		mn.e  = neighbours->ne;
 		mn.sw = neighbours->w;
 		mn.se = neighbours->e;
 
-		edge_step(changes, &mn, NULL, xp, yp, EDGE_SOUTH);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_SOUTH|EDGE_WEST);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_SOUTH|EDGE_EAST);
-
-		yp += BUCKETSZ;
+		ghost_step(changes, tree, &mn, xp, yp - BUCKETSZ, max, max, all);
 	}
 
-	if (!neighbours->s) {
-		yp += BUCKETSZ;
-
-                union bucket_neighbours mn;
+	if (!neighbours->s && (b1 || h.rows[BUCKETSZ])) {
+		union bucket_neighbours mn = { 0 };
 		mn.n  = bucket;
 		mn.w  = neighbours->sw;
 		mn.e  = neighbours->se;
 		mn.nw = neighbours->w;
 		mn.ne = neighbours->e;
 
-		edge_step(changes, &mn, NULL, xp, yp, EDGE_NORTH);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_NORTH|EDGE_WEST);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_NORTH|EDGE_EAST);
-
-		yp -= BUCKETSZ;
+		ghost_step(changes, tree, &mn, xp, yp + BUCKETSZ, 0, 0, all);
 	}
 
-	if (!neighbours->w) {
-		xp -= BUCKETSZ;
-
-                union bucket_neighbours mn;
+	if (!neighbours->w && (b1 || (cols & 1))) {
+		union bucket_neighbours mn = { 0 };
 		mn.e  = bucket;
 		mn.n  = neighbours->nw;
 		mn.s  = neighbours->sw;
 		mn.ne = neighbours->n;
 		mn.se = neighbours->s;
 
-		edge_step(changes, &mn, NULL, xp, yp, EDGE_EAST);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_NORTH|EDGE_EAST);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_SOUTH|EDGE_EAST);
-
-		xp += BUCKETSZ;
+		ghost_step(changes, tree, &mn, xp - BUCKETSZ, yp,
+		           0, max, (bucket_row)1 << max);
 	}
 
-	if (!neighbours->e) {
-		xp += BUCKETSZ;
-
-                union bucket_neighbours mn;
+	if (!neighbours->e && (b1 || (cols >> max))) {
+		union bucket_neighbours mn = { 0 };
 		mn.w  = bucket;
 		mn.n  = neighbours->ne;
 		mn.s  = neighbours->se;
 		mn.nw = neighbours->n;
 		mn.sw = neighbours->s;
 
-		edge_step(changes, &mn, NULL, xp, yp, EDGE_WEST);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_NORTH|EDGE_WEST);
-		corner_step(changes, &mn, NULL,
-		            xp, yp, EDGE_SOUTH|EDGE_WEST);
+		ghost_step(changes, tree, &mn, xp + BUCKETSZ, yp, 0, max, 1);
+	}
+
+	if (!b1)
+		return remembered;
+
+	/*
+	 * A diagonal neighbour is covered by the two neighbours between
+	 * it and this bucket, when either of them exists.
+	 */
+	const bucket_row first = h.rows[1], last = h.rows[BUCKETSZ];
 
-		xp -= BUCKETSZ;
+	if (!neighbours->nw && !neighbours->n && !neighbours->w && (first & 1)) {
+		union bucket_neighbours mn = { 0 };
+		mn.se = bucket;
+		ghost_step(changes, tree, &mn, xp - BUCKETSZ, yp - BUCKETSZ,
+		           max, max, (bucket_row)1 << max);
 	}
 
+	if (!neighbours->ne && !neighbours->n && !neighbours->e && (first >> max)) {
+		union bucket_neighbours mn = { 0 };
+		mn.sw = bucket;
+		ghost_step(changes, tree, &mn, xp + BUCKETSZ, yp - BUCKETSZ,
+		           max, max, 1);
+	}
 
-	struct { coordinate x, y; } delta[8] = {
-		{ -1,  0 }, // w
-		{ +1,  0 }, // e
-		{  0, -1 }, // n
-		{  0, +1 }, // s
-		{ -1, -1 }, // nw
-		{ +1, -1 }, // ne
-		{ -1, +1 }, // sw
-		{ +1, +1 }, // se
-	};
-	unsigned deltasz = sizeof(delta)/sizeof(delta[0]);
+	if (!neighbours->sw && !neighbours->s && !neighbours->w && (last & 1)) {
+		union bucket_neighbours mn = { 0 };
+		mn.ne = bucket;
+		ghost_step(changes, tree, &mn, xp - BUCKETSZ, yp + BUCKETSZ,
+		           0, 0, (bucket_row)1 << max);
+	}
+
+	if (!neighbours->se && !neighbours->s && !neighbours->e && (last >> max)) {
+		union bucket_neighbours mn = { 0 };
+		mn.nw = bucket;
+		ghost_step(changes, tree, &mn, xp + BUCKETSZ, yp + BUCKETSZ,
+		           0, 0, 1);
+	}
+	return remembered;
+}
+
+/*
+ * Returns non-zero when the buffered engine changed a cell in or
+ * around bucket in the last generation.
+ */
+static int is_touched(struct bucket *bucket)
+{
+	if (bucket->touched & BUCKET_TOUCHED)
+		return 1;
+
+	for(unsigned i = 0; i < 8; ++i) {
+		struct bucket *b = bucket->neighbours.items[i];
+		if (b && (b->touched & (1 << neighbour_opposite[i])))
+			return 1;
+	}
+	return 0;
+}
+
+static int is_active(struct bucket *bucket, int buffered)
+{
+	return bucket->active || (buffered && is_touched(bucket));
+}
+
+/*
+ * Returns non-zero when no bucket in the leaf has to be stepped,
+ * counting them as skipped.
+ */
+static int is_idle(struct quad *leaf, struct state_change_buffer *changes,
+                   int buffered)
+{
+	for(struct bucket *cur = leaf->items.head; cur; cur = cur->next) {
+		if (is_active(cur, buffered))
+			return 0;
+	}
+
+	struct change_segments *seg = changes->opaque;
+	__atomic_fetch_add(&seg->skipped, leaf->count, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static int is_idle_step(struct quad *leaf,
+                        struct state_change_buffer *changes)
+{
+	return is_idle(leaf, changes, 0);
+}
+
+static int is_idle_buffered_step(struct quad *leaf,
+                                 struct state_change_buffer *changes)
+{
+	return is_idle(leaf, changes, 1);
+}
 
+static void leaf_step(struct quad *now, struct state_change_buffer *changes,
+                      int buffered)
+{
+	assert(now);
+	assert(changes);
+	assert(now->leaf);
+
+	unsigned stepped = 0, skipped = 0, remembered = 0;
+
+	for(struct bucket *cur = now->items.head; cur; cur = cur->next) {
+		if (!is_active(cur, buffered)) {
+			++skipped;
+			continue;
+		}
 
-	for(coordinate y = 1; y < BUCKETSZ-1; ++y) {
-		for(coordinate x = 1; x < BUCKETSZ-1; ++x) {
-			unsigned n = 0;
+		remembered += bucket_step(now->tree, cur, &cur->neighbours,
+		                          changes, buffered ? cur->back : NULL);
+		++stepped;
 
-			for(unsigned i = 0; i < deltasz; ++i) {
-				n += index_bucket(bucket,
-			          	  	  x + delta[i].x,
-			          	  	  y + delta[i].y);
+		// run_swap only swaps the buffers of buckets stepped.
+		cur->active = buffered;
+	}
+
+	struct change_segments *seg = changes->opaque;
+	__atomic_fetch_add(&seg->stepped, stepped, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&seg->skipped, skipped, __ATOMIC_RELAXED);
+	if (remembered)
+		__atomic_fetch_add(&seg->remembered, remembered, __ATOMIC_RELAXED);
+}
+
+static void run_step(struct quad *now, struct state_change_buffer *changes)
+{
+	leaf_step(now, changes, 0);
+}
+
+static void run_buffered_step(struct quad *now,
+                              struct state_change_buffer *changes)
+{
+	leaf_step(now, changes, 1);
+}
+
+/*
+ * Makes the back buffer of every bucket stepped the front buffer,
+ * leaving the previous generation behind, and records which of its
+ * neighbours the changes border. Buckets that have been empty for
+ * both generations are recorded as a dead cell, so that update()
+ * collects them.
+ *
+ * Buckets skipped are left alone, as both their buffers already
+ * hold the same generation.
+ */
+static void run_swap(struct quad *now, struct state_change_buffer *changes)
+{
+	assert(now->leaf);
+
+	const coordinate max = BUCKETSZ-1;
+	int changed = 0;
+
+	for(struct bucket *cur = now->items.head; cur; cur = cur->next) {
+		cur->touched = 0;
+		if (!cur->active)
+			continue;
+		cur->active = 0;
+
+		bucket_row live = 0, diff = 0, first = 0, last = 0;
+
+		for(coordinate y = 0; y < BUCKETSZ; ++y) {
+			bucket_row was = load_row(cur->bucket, y);
+			bucket_row is  = load_row(cur->back, y);
+			store_row(cur->bucket, y, is);
+			store_row(cur->back, y, was);
+
+			live |= was | is;
+			diff |= was ^ is;
+			if (y == 0)
+				first = was ^ is;
+			if (y == max)
+				last = was ^ is;
+		}
+
+		if (diff) {
+			unsigned short t = BUCKET_TOUCHED;
+			for(unsigned i = 0; i < 8; ++i) {
+				bucket_row rows = diff;
+				if (neighbour_delta[i].y < 0)
+					rows = first;
+				else if (neighbour_delta[i].y > 0)
+					rows = last;
+
+				if (neighbour_delta[i].x < 0)
+					rows &= 1;
+				else if (neighbour_delta[i].x > 0)
+					rows >>= max;
+
+				if (rows)
+					t |= 1 << i;
 			}
+			cur->touched = t;
+			cur->population = UNMEASURED;
+			changed = 1;
+		}
 
-			cell(changes, n, xp+x, yp+y, index_bucket(bucket, x, y));
+		if (!live) {
+			// Nothing born or died, but update() collects it.
+			struct bucket_change c;
+			memset(&c, 0, sizeof(c));
+			c.x = cur->x;
+			c.y = cur->y;
+			if (!append_bucket(changes, &c))
+				fail_step(changes);
 		}
 	}
+
+	if (changed)
+		mark_dirty(now);
 }
 
-struct step_arguments {
-	struct quad *now;
-	struct state_change_buffer *changes;
+/*
+ * Returns non-zero when run_swap has nothing to do in the leaf.
+ */
+static int is_idle_swap(struct quad *leaf,
+                        struct state_change_buffer *changes)
+{
+	(void)(changes);
+
+	for(struct bucket *cur = leaf->items.head; cur; cur = cur->next) {
+		if (cur->active)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Returns non-zero when run_changes has nothing to record in the leaf.
+ */
+static int is_idle_changes(struct quad *leaf,
+                           struct state_change_buffer *changes)
+{
+	(void)(changes);
+
+	for(struct bucket *cur = leaf->items.head; cur; cur = cur->next) {
+		if (cur->touched)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Records the difference between the front and back buffers.
+ */
+static void run_changes(struct quad *now, struct state_change_buffer *changes)
+{
+	assert(now->leaf);
+
+	for(struct bucket *cur = now->items.head; cur; cur = cur->next) {
+		bucket_row born[BUCKETSZ], died[BUCKETSZ];
+
+		for(coordinate y = 0; y < BUCKETSZ; ++y) {
+			bucket_row was = load_row(cur->back, y);
+			bucket_row is  = load_row(cur->bucket, y);
+
+			born[y] = is & ~was;
+			died[y] = was & ~is;
+		}
+
+		emit(changes, cur->x, cur->y, born, died);
+	}
+}
+
+// {{{1 blocked step
+
+/*
+ * Most buckets a task of a blocked step takes on, unless a single
+ * leaf holds more.
+ */
+#define BLOCKSZ 64
+
+/*
+ * A bucket as seen by the task stepping a block over several
+ * generations. Tiles of buckets that do not exist start out empty,
+ * and the neighbours missing at the edge of the tiles are taken to
+ * stay empty. What this gets wrong moves in by a cell a generation,
+ * so that it does not get through a ring of tiles while the block
+ * advances at most BUCKETSZ generations.
+ */
+struct tile {
+	coordinate x, y;
+	struct bucket *bucket;
+	/*
+	 * 0 for the buckets of the block, 1 for the ring around it, and
+	 * 2 for the ring around the empty tiles the block owns.
+	 */
+	unsigned ring;
+	/*
+	 * Non-zero when the block records the changes of the tile.
+	 */
+	int owned;
+	/*
+	 * Non-zero when the tile has to be stepped, and when its cells
+	 * changed in the last generation.
+	 */
+	int active, changed;
+	struct tile *neighbours[8];
+	/*
+	 * Cells of the even and the odd generations.
+	 */
+	value cells[2][BUCKETSZ * BUCKETSZ / VALUE_BIT];
 };
 
-static void run_step(struct quad *now, struct state_change_buffer *changes);
+struct tiles {
+	unsigned length, capacity;
+	struct tile *items;
+	/*
+	 * Open addressing table of one more than the index of each tile,
+	 * with mask+1 slots.
+	 */
+	unsigned *slots;
+	size_t mask;
+};
 
-static void run_stepa(void *opaque, int run)
+static void neighbour_of(struct tree *tree, coordinate bx, coordinate by,
+                         unsigned i, coordinate *x, coordinate *y)
 {
-	struct step_arguments *args = opaque;
-	struct quad *now = args->now;
-	struct state_change_buffer *changes = args->changes;
+	*x = wrap(tree, (bx + neighbour_delta[i].x) * BUCKETSZ) / BUCKETSZ;
+	*y = wrap(tree, (by + neighbour_delta[i].y) * BUCKETSZ) / BUCKETSZ;
+}
 
-	free(args);
+static size_t tile_slot(const struct tiles *t, coordinate x, coordinate y)
+{
+	return (morton(x, y) * 0x9e3779b97f4a7c15) >> 32 & t->mask;
+}
 
-	if (run)
-		run_step(now, changes);
+static struct tile* tile_find(const struct tiles *t,
+                              coordinate x, coordinate y)
+{
+	for(size_t i = tile_slot(t, x, y);; i = (i + 1) & t->mask) {
+		if (!t->slots[i])
+			return NULL;
+
+		struct tile *tile = t->items + t->slots[i] - 1;
+		if (tile->x == x && tile->y == y)
+			return tile;
+	}
 }
 
-static void run_step(struct quad *now, struct state_change_buffer *changes)
+/*
+ * Adds a tile for the bucket at x, y unless there is one. bucket is
+ * the bucket there, NULL when there is none.
+ *
+ * Returns zero when out of memory. Tiles may move when one is added.
+ */
+static int tile_add(struct tiles *t, coordinate x, coordinate y,
+                    struct bucket *bucket, unsigned ring)
 {
-	assert(now);
-	assert(changes);
+	size_t i = tile_slot(t, x, y);
+	for(; t->slots[i]; i = (i + 1) & t->mask) {
+		struct tile *tile = t->items + t->slots[i] - 1;
+		if (tile->x == x && tile->y == y)
+			return 1;
+	}
 
-	if (now->leaf) {
+	if (t->length == t->capacity) {
+		unsigned new_cap = t->capacity * 2;
+		void *tmp = realloc(t->items, sizeof(struct tile) * new_cap);
+		if (!tmp)
+			return 0;
+		t->items = tmp;
+		t->capacity = new_cap;
+	}
 
-		union bucket_neighbours neighbours;
+	struct tile *tile = t->items + t->length++;
+	t->slots[i] = t->length;
+
+	tile->x = x;
+	tile->y = y;
+	tile->bucket = bucket;
+	tile->ring = ring;
+	tile->owned = ring == 0;
+	tile->active = 1;
+	tile->changed = 0;
+	if (bucket)
+		memcpy(tile->cells[0], bucket->bucket, sizeof(tile->cells[0]));
+	else
+		memset(tile->cells[0], 0, sizeof(tile->cells[0]));
+	return 1;
+}
 
-		struct bucket *cur = now->items.head;
-		while(cur) {
+static int add_block(struct tiles *t, struct quad *quad)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i) {
+			if (!add_block(t, quad->children[i]))
+				return 0;
+		}
+		return 1;
+	}
 
-			struct { coordinate x, y; } delta[8] = {
-				{ -1,  0 }, // w
-				{ +1,  0 }, // e
-				{  0, -1 }, // n
-				{  0, +1 }, // s
-				{ -1, -1 }, // nw
-				{ +1, -1 }, // ne
-				{ -1, +1 }, // sw
-				{ +1, +1 }, // se
-			};
-			unsigned deltasz = sizeof(delta)/sizeof(delta[0]);
-
-
-			for(unsigned i = 0; i < deltasz; ++i) {
-				coordinate x, y;
-				x = (cur->x + delta[i].x) * BUCKETSZ;
-				y = (cur->y + delta[i].y) * BUCKETSZ;
-				struct bucket *b = find_bucket(now, x, y, NULL);
-				neighbours.items[i] = b;
+	for(struct bucket *cur = quad->items.head; cur; cur = cur->next) {
+		if (!tile_add(t, cur->x, cur->y, cur, 0))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Returns the bucket at x, y, or NULL when there is none.
+ */
+static struct bucket* tile_bucket(const struct tiles *t, struct quad *quad,
+                                  coordinate x, coordinate y)
+{
+	struct tile *tile = tile_find(t, x, y);
+	if (tile)
+		return tile->bucket;
+	return find_bucket(quad, x * BUCKETSZ, y * BUCKETSZ, NULL);
+}
+
+/*
+ * Returns non-zero when the block records the births in the empty
+ * tile at x, y. Only a neighbour to be stepped can bring it to life,
+ * and the block holding the first of those does.
+ */
+static int is_owner(const struct tiles *t, struct quad *quad,
+                    coordinate x, coordinate y)
+{
+	for(unsigned i = 0; i < 8; ++i) {
+		coordinate nx, ny;
+		neighbour_of(quad->tree, x, y, i, &nx, &ny);
+
+		struct bucket *b = tile_bucket(t, quad, nx, ny);
+		if (!b || !b->active)
+			continue;
+
+		struct tile *tile = tile_find(t, nx, ny);
+		return tile && tile->ring == 0;
+	}
+	return 0;
+}
+
+/*
+ * Adds the tiles of the buckets below quad, and of the rings around
+ * them.
+ *
+ * Returns zero when out of memory.
+ */
+static int add_tiles(struct tiles *t, struct quad *quad)
+{
+	struct tree *tree = quad->tree;
+
+	if (!add_block(t, quad))
+		return 0;
+
+	unsigned block = t->length;
+	for(unsigned i = 0; i < block; ++i) {
+		struct bucket *b = t->items[i].bucket;
+		for(unsigned j = 0; j < 8; ++j) {
+			coordinate x, y;
+			neighbour_of(tree, b->x, b->y, j, &x, &y);
+			if (!tile_add(t, x, y, b->neighbours.items[j], 1))
+				return 0;
+		}
+	}
+
+	unsigned ring = t->length;
+	for(unsigned i = block; i < ring; ++i) {
+		coordinate x = t->items[i].x, y = t->items[i].y;
+		if (t->items[i].bucket || !is_owner(t, quad, x, y))
+			continue;
+
+		t->items[i].owned = 1;
+		for(unsigned j = 0; j < 8; ++j) {
+			coordinate nx, ny;
+			neighbour_of(tree, x, y, j, &nx, &ny);
+			if (tile_find(t, nx, ny))
+				continue;
+
+			struct bucket *b = find_bucket(quad, nx * BUCKETSZ,
+			                               ny * BUCKETSZ, NULL);
+			if (!tile_add(t, nx, ny, b, 2))
+				return 0;
+		}
+	}
+
+	for(unsigned i = 0; i < t->length; ++i) {
+		struct tile *tile = t->items + i;
+		for(unsigned j = 0; j < 8; ++j) {
+			coordinate x, y;
+			neighbour_of(tree, tile->x, tile->y, j, &x, &y);
+			tile->neighbours[j] = tile_find(t, x, y);
+		}
+	}
+	return 1;
+}
+
+/*
+ * Advances the tiles by generations, stepping only those next to a
+ * change after the first one. The last generation is only computed
+ * for the tiles owned.
+ */
+static void run_tiles(struct tiles *t, const struct rule *rule,
+                      unsigned generations)
+{
+	for(unsigned g = 1; g <= generations; ++g) {
+		unsigned src = (g - 1) & 1, dst = g & 1;
+
+		for(unsigned i = 0; i < t->length; ++i) {
+			struct tile *tile = t->items + i;
+			tile->changed = 0;
+
+			if (g == generations && !tile->owned)
+				continue;
+			if (!tile->active) {
+				memcpy(tile->cells[dst], tile->cells[src],
+				       sizeof(tile->cells[dst]));
+				continue;
 			}
 
-			bucket_step(now, cur, &neighbours, changes);
-			cur = cur->next;
+			const value *n[8];
+			for(unsigned j = 0; j < 8; ++j) {
+				struct tile *nt = tile->neighbours[j];
+				n[j] = nt ? nt->cells[src] : NULL;
+			}
+
+			struct halo h;
+			load_halo_cells(&h, tile->cells[src], n);
+
+			bucket_row next[BUCKETSZ];
+			kernel_step(rule, &h, next);
+
+			for(coordinate y = 0; y < BUCKETSZ; ++y) {
+				if (next[y] != h.rows[y+1])
+					tile->changed = 1;
+				store_row(tile->cells[dst], y, next[y]);
+			}
 		}
-	} else {
+
+		for(unsigned i = 0; i < t->length; ++i) {
+			struct tile *tile = t->items + i;
+			tile->active = tile->changed;
+			for(unsigned j = 0; j < 8 && !tile->active; ++j) {
+				struct tile *nt = tile->neighbours[j];
+				tile->active = nt && nt->changed;
+			}
+		}
+	}
+}
+
+/*
+ * Advances the buckets below now by tree->stride generations at once,
+ * recording what changed in between as a single step. The buckets
+ * are left marked to be stepped, as other blocks look at them, until
+ * run_settle.
+ */
+static void run_block(struct quad *now, struct state_change_buffer *changes)
+{
+	struct tree *tree = now->tree;
+
+	size_t slots = 64;
+	while(slots < (size_t)now->count * 50)
+		slots *= 2;
+
+	struct tiles t;
+	t.length = 0;
+	t.capacity = now->count * 4 + 16;
+	t.items = malloc(sizeof(struct tile) * t.capacity);
+	t.slots = calloc(slots, sizeof(unsigned));
+	t.mask = slots - 1;
+
+	if (!t.items || !t.slots || !add_tiles(&t, now)) {
+		free(t.items);
+		free(t.slots);
+		fail_step(changes);
+		return;
+	}
+
+	run_tiles(&t, &tree->rule, tree->stride);
+
+	unsigned stepped = 0;
+	for(unsigned i = 0; i < t.length; ++i) {
+		struct tile *tile = t.items + i;
+		if (!tile->owned)
+			continue;
+
+		const value *first = tile->bucket ? tile->bucket->bucket : NULL;
+		const value *last = tile->cells[tree->stride & 1];
+		bucket_row born[BUCKETSZ], died[BUCKETSZ];
+		for(coordinate y = 0; y < BUCKETSZ; ++y) {
+			bucket_row was = row_cells(first, y);
+			bucket_row is = load_row(last, y);
+			born[y] = is & ~was;
+			died[y] = was & ~is;
+		}
+		emit(changes, tile->x, tile->y, born, died);
+
+		if (tile->bucket)
+			++stepped;
+	}
+
+	free(t.items);
+	free(t.slots);
+
+	struct change_segments *seg = changes->opaque;
+	__atomic_fetch_add(&seg->stepped, stepped, __ATOMIC_RELAXED);
+}
+
+static int has_active(struct quad *quad)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i) {
+			if (has_active(quad->children[i]))
+				return 1;
+		}
+		return 0;
+	}
+
+	for(struct bucket *cur = quad->items.head; cur; cur = cur->next) {
+		if (cur->active)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns non-zero when no bucket in the block has to be stepped,
+ * counting them as skipped.
+ */
+static int is_idle_block(struct quad *block,
+                         struct state_change_buffer *changes)
+{
+	if (has_active(block))
+		return 0;
+
+	struct change_segments *seg = changes->opaque;
+	__atomic_fetch_add(&seg->skipped, block->count, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static int is_settled(struct quad *block,
+                      struct state_change_buffer *changes)
+{
+	(void)(changes);
+
+	return !has_active(block);
+}
+
+/*
+ * Marks the buckets stepped by run_block as done, until update()
+ * wakes them again.
+ */
+static void run_settle(struct quad *now, struct state_change_buffer *changes)
+{
+	if (!now->leaf) {
 		for(unsigned i = 0; i < 4; ++i)
-			run_step(now->children[i], changes);
+			run_settle(now->children[i], changes);
+		return;
 	}
+
+	for(struct bucket *cur = now->items.head; cur; cur = cur->next)
+		cur->active = 0;
 }
 
-void step(struct quad *now,
-          struct state_change_buffer *changes,
-          void *q)
+// 1}}}
+
+struct step_arguments {
+	struct quad *now;
+	struct state_change_buffer *changes;
+	void (*run)(struct quad*, struct state_change_buffer*);
+};
+
+static void run_stepa(void *opaque, int run)
 {
-	struct workq *queue = q;
+	struct step_arguments *args = opaque;
+	struct quad *now = args->now;
+	struct state_change_buffer *changes = args->changes;
+	void (*func)(struct quad*, struct state_change_buffer*) = args->run;
+
+	free(args);
+
+	if (run)
+		func(now, changes);
+}
+
+/*
+ * Adds a work item running func for every leaf below now, or for
+ * every quad holding at most block buckets when block is non-zero.
+ * When is_idle is non-NULL, those for which it returns non-zero are
+ * skipped.
+ */
+static void fan_out(struct quad *now,
+                    struct state_change_buffer *changes,
+                    struct workq *queue,
+                    void (*func)(struct quad*, struct state_change_buffer*),
+                    int (*is_idle)(struct quad*,
+                                   struct state_change_buffer*),
+                    unsigned block)
+{
+	if (now->leaf || (block && now->count <= block)) {
+		if (is_idle && is_idle(now, changes))
+			return;
 
-	if (now->leaf) {
 		struct step_arguments *a = malloc(sizeof(struct step_arguments));
 		if (!a)
 			return;
 
 		a->now = now;
 		a->changes = changes;
-		workq_add(queue, a, run_stepa);
+		a->run = func;
+		workq_add_on(queue, quad_node(now), a, run_stepa);
 	} else {
 		for(unsigned i = 0; i < 4; ++i)
-			step(now->children[i], changes, queue);
+			fan_out(now->children[i], changes, queue, func, is_idle,
+			        block);
 	}
 }
 
+void step(struct quad *now,
+          struct state_change_buffer *changes,
+          void *q)
+{
+	reserve_segments(changes, workq_workers(q));
+	fan_out(now, changes, q, run_step, is_idle_step, 0);
+}
+
+int conway_step(struct conway *cw, void *queue)
+{
+	cw->changes.length = 0;
+	cw->changes.buckets_length = 0;
+
+	struct change_segments *seg = cw->changes.opaque;
+	seg->failed = 0;
+
+	// Buckets left alone by one rule may not be by the next.
+	struct rule rule = cw->phases[cw->phase];
+	if (rule.born != cw->tree.rule.born
+	 || rule.survive != cw->tree.rule.survive) {
+		cw->tree.rule = rule;
+		wake_all(cw->root);
+	}
+
+	switch(cw->engine) {
+	case ENGINE_BUCKET:
+		if (cw->stride > 1) {
+			reserve_segments(&cw->changes, workq_workers(queue));
+			fan_out(cw->root, &cw->changes, queue, run_block,
+			        is_idle_block, BLOCKSZ);
+			workq_wait(queue);
+			fan_out(cw->root, &cw->changes, queue, run_settle,
+			        is_settled, BLOCKSZ);
+			workq_wait(queue);
+			return merge(cw);
+		}
+		step(cw->root, &cw->changes, queue);
+		workq_wait(queue);
+		return merge(cw);
+	case ENGINE_BUFFERED:
+		reserve_segments(&cw->changes, workq_workers(queue));
+		fan_out(cw->root, &cw->changes, queue, run_buffered_step,
+		        is_idle_buffered_step, 0);
+		workq_wait(queue);
+		fan_out(cw->root, &cw->changes, queue, run_swap, is_idle_swap, 0);
+		workq_wait(queue);
+		return merge(cw);
+	case ENGINE_HASHLIFE:
+		if (!hashlife_step(cw->opaque, &cw->changes))
+			return 0;
+		return merge(cw);
+	}
+	return 0;
+}
+
+int conway_advance(struct conway *cw, unsigned generations, void *queue)
+{
+	if (cw->engine == ENGINE_HASHLIFE) {
+		cw->changes.length = 0;
+		cw->changes.buckets_length = 0;
+		struct change_segments *seg = cw->changes.opaque;
+		seg->failed = 0;
+		if (!hashlife_advance(cw->opaque, generations, &cw->changes)
+		 || !merge(cw))
+			return 0;
+
+		cw->generation += generations;
+		int ok = apply_changes(cw);
+		cw->changes.length = 0;
+		cw->changes.buckets_length = 0;
+		return ok;
+	}
+
+	// The bucket engine keeps every generation in the quadtree, but
+	// the workers need only meet once every BUCKETSZ of them.
+	enum conway_engine engine = cw->engine;
+	unsigned log_stride = 0;
+	while((1u << log_stride) < cw->stride)
+		log_stride++;
+
+	int ok = 1;
+	while(ok && generations) {
+		unsigned k = 0;
+		if (!cw->phase && !(cw->rule.born & 1)) {
+			while((2u << k) <= BUCKETSZ && (2u << k) <= generations)
+				k++;
+		}
+
+		if (cw->engine != ENGINE_BUCKET || cw->stride != 1u << k)
+			ok = conway_engine(cw, ENGINE_BUCKET, k);
+		ok = ok && conway_step(cw, queue) && conway_update(cw, queue);
+		if (ok)
+			generations -= cw->stride;
+	}
+
+	cw->changes.length = 0;
+	cw->changes.buckets_length = 0;
+	return conway_engine(cw, engine, log_stride) && ok;
+}
+
+void conway_changes(struct conway *cw, void *queue)
+{
+	if (cw->engine != ENGINE_BUFFERED)
+		return;
+
+	fan_out(cw->root, &cw->changes, queue, run_changes, is_idle_changes,
+	        0);
+	workq_wait(queue);
+	merge(cw);
+}
 
 /* 1}}} */
 
+// {{{1 relayout
+
+struct placed {
+	uint64_t key;
+	struct bucket *bucket;
+};
+
+struct relayout {
+	struct tree *tree;
+	/*
+	 * Arena the tree is copied into.
+	 */
+	struct arena arena;
+	/*
+	 * Buckets of the leaf being copied, to be sorted by Morton code.
+	 */
+	struct placed *items;
+	size_t capacity;
+	/*
+	 * Blocks copied, which the old arena gives back all at once.
+	 */
+	unsigned long long moved;
+};
+
+static int compare_placed(const void *a, const void *b)
+{
+	const struct placed *p = a, *q = b;
+	if (p->key != q->key)
+		return p->key < q->key ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Copies the children or buckets of from below to, a copy of from
+ * which is to end up at self, children before grandchildren so that
+ * every subtree is laid out in Morton order. Each copied bucket keeps
+ * the address of its original in prev for now.
+ *
+ * Returns zero when out of memory.
+ */
+static int copy_below(struct relayout *r, const struct quad *from,
+                      struct quad *to, struct quad *self)
+{
+	if (!from->leaf) {
+		struct quad *children = arena_alloc(&r->arena,
+		                                    sizeof(struct quad) * 4);
+		if (!children)
+			return 0;
+		r->moved++;
+
+		for(unsigned i = 0; i < 4; ++i) {
+			children[i] = *from->children[i];
+			children[i].parent = self;
+			to->children[i] = children + i;
+		}
+		for(unsigned i = 0; i < 4; ++i) {
+			if (!copy_below(r, from->children[i], children + i,
+			                children + i))
+				return 0;
+		}
+		return 1;
+	}
+
+	size_t length = 0;
+	for(struct bucket *b = from->items.head; b; b = b->next) {
+		if (length == r->capacity) {
+			size_t capacity = r->capacity ? r->capacity * 2 : 16;
+			void *tmp = realloc(r->items, capacity * sizeof(struct placed));
+			if (!tmp)
+				return 0;
+			r->items = tmp;
+			r->capacity = capacity;
+		}
+
+		// Offsets from the corner of the leaf keep their order, wrapped or not.
+		r->items[length].key = morton(b->x - from->west, b->y - from->north);
+		r->items[length].bucket = b;
+		length++;
+	}
+	if (length > 1)
+		qsort(r->items, length, sizeof(struct placed), compare_placed);
+
+	to->items.head = NULL;
+	to->items.tail = NULL;
+	for(size_t i = 0; i < length; ++i) {
+		struct bucket *old = r->items[i].bucket;
+		struct bucket *b = arena_alloc_on(&r->arena,
+		                                  node_of(r->tree, old->x, old->y),
+		                                  sizeof(struct bucket));
+		if (!b)
+			return 0;
+		r->moved++;
+
+		memcpy(b, old, sizeof(struct bucket));
+		b->num = i;
+		b->prev = old;
+		b->next = NULL;
+		if (to->items.tail)
+			to->items.tail->next = b;
+		else
+			to->items.head = b;
+		to->items.tail = b;
+	}
+	return 1;
+}
+
+/*
+ * Points the originals of the buckets copied below quad at their copy.
+ */
+static void forward(struct quad *quad)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i)
+			forward(quad->children[i]);
+		return;
+	}
+
+	for(struct bucket *b = quad->items.head; b; b = b->next)
+		b->prev->prev = b;
+}
+
+/*
+ * Links the buckets copied below quad to each other rather than to
+ * the originals.
+ */
+static void relink(struct quad *quad)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i)
+			relink(quad->children[i]);
+		return;
+	}
+
+	struct bucket *prev = NULL;
+	for(struct bucket *b = quad->items.head; b; b = b->next) {
+		b->prev = prev;
+		prev = b;
+
+		for(unsigned i = 0; i < 8; ++i) {
+			if (b->neighbours.items[i])
+				b->neighbours.items[i] = b->neighbours.items[i]->prev;
+		}
+	}
+}
+
+int conway_relayout(struct conway *cw)
+{
+	if (!cw) return 0;
+
+	struct quad *root = cw->root;
+	struct tree *tree = root->tree;
+	if (!tree) return 0;
+
+	struct relayout r;
+	r.tree = tree;
+	r.items = NULL;
+	r.capacity = 0;
+	r.moved = 0;
+	if (!arena_create_like(&r.arena, &tree->arena))
+		return 0;
+
+	// Nothing is touched until the whole tree has been copied.
+	struct quad top = *root;
+	int ok = copy_below(&r, root, &top, root);
+	free(r.items);
+	if (!ok) {
+		arena_destroy(&r.arena);
+		return 0;
+	}
+
+	forward(&top);
+	relink(&top);
+	for(size_t i = 0; i < tree->index_capacity; ++i) {
+		if (tree->index[i].bucket)
+			tree->index[i].bucket = tree->index[i].bucket->prev;
+	}
+	*root = top;
+
+	// Every block of the old arena goes back at once.
+	struct arena_stats *from = &tree->arena.stats, *to = &r.arena.stats;
+	to->allocations += from->allocations;
+	to->reused += from->reused;
+	to->frees += from->frees + r.moved;
+	to->slabs += from->slabs;
+
+	arena_destroy(&tree->arena);
+	tree->arena = r.arena;
+	return 1;
+}
+
+// 1}}}
+
 void release(struct quad *quad)
 {
+	if (quad->tree) {
+		// Everything below came from the arena, drop it at once.
+		arena_clear(&quad->tree->arena);
+		free(quad->tree->index);
+		quad->tree->index = NULL;
+		quad->tree->index_capacity = 0;
+		quad->tree->index_count = 0;
+		quad->leaf = 1;
+		quad->count = 0;
+		quad->population = 0;
+		quad->dirty = 0;
+		quad->items.head = NULL;
+		quad->items.tail = NULL;
+		return;
+	}
+
 	if (quad->leaf) {
 		struct bucket *cur = quad->items.head;
 		struct bucket *del = cur;
@@ -1,14 +1,18 @@
 
 #include <stdint.h>
 
+#include "arena.h"
+
+struct memo;
+
 /*
  * Change the coordinate type to any unsigned integer.
  * The coordinate value affects the size of the available
  * space.
  * Must be unsigned, for defined wrap-around.
  */
-#define COORD_MAX UINT16_MAX
-typedef uint16_t coordinate;
+#define COORD_MAX UINT64_MAX
+typedef uint64_t coordinate;
 
 /*
  * Controls what integer type is used for the cell-bitmap
@@ -24,26 +28,168 @@ typedef unsigned char value;
  * Must be evenly divisible by value, as all bits are
  * assumed to be used in order to perform fast checks
  * for empty buckets.
+ *
+ * One of 16, 32 or 64, so that a row fits an integer.
+ * Chosen when building, e.g. make BUCKETSZ=64.
  */
+#ifndef BUCKETSZ
 #define BUCKETSZ 16
+#endif
 /*
  * Controls the maximum number of child node and buckets
  * in a quadtree node before it is split.
  */
 #define QUADSZ 4
+/*
+ * Controls when a quadtree node is merged back into a leaf: once
+ * the buckets below it number no more than this. Kept well below
+ * QUADSZ, so nodes do not split and merge over and over.
+ */
+#define QUADMERGE (QUADSZ / 2)
+
+/*
+ * The buckets adjacent to a bucket, NULL where there is none.
+ */
+union bucket_neighbours
+{
+	struct {
+		struct bucket *w,  *e,  *n,  *s,
+		              *nw, *ne, *sw, *se;
+	};
+	struct bucket *items[8];
+};
+
+#define BUCKET_TOUCHED (1 << 8)
 
 struct bucket {
 	coordinate x, y, num;
 	struct bucket *next, *prev;
+	union bucket_neighbours neighbours;
+	/*
+	 * Non-zero when the bucket has to be stepped, because a cell in
+	 * it or bordering it changed since it was last stepped.
+	 */
+	unsigned char active;
+	/*
+	 * Set by the buffered engine: bit i when the last generation
+	 * changed cells bordering neighbour i, BUCKET_TOUCHED when it
+	 * changed any cell.
+	 */
+	unsigned short touched;
+	/*
+	 * Live cells in the bucket, and the smallest rectangle holding
+	 * them, in cells from its top left one with both ends included,
+	 * as of the last census().
+	 */
+	unsigned short population;
+	struct {
+		unsigned char west, east, north, south;
+	} box;
 
 	value bucket[BUCKETSZ * BUCKETSZ / VALUE_BIT];
+	/*
+	 * The next generation when double buffered, and the previous
+	 * one once the buffers are swapped.
+	 */
+	value back[BUCKETSZ * BUCKETSZ / VALUE_BIT];
+};
+
+/*
+ * A Life-like rule. Bit n of born is set when a dead cell with n live
+ * neighbours comes alive, bit n of survive when a live one stays so.
+ */
+struct rule {
+	unsigned short born, survive;
+};
+
+#define RULE_CONWAY ((struct rule){ 1 << 3, 1 << 2 | 1 << 3 })
+
+/*
+ * Parses a rule in B/S notation, such as "B36/S23".
+ *
+ * Returns non-zero on success.
+ */
+int rule_parse(struct rule *rule, const char *spec);
+
+
+/*
+ * A bucket in the index of a tree. key is the Morton code of the low
+ * half of its coordinates, so most probes need not touch the bucket.
+ */
+struct index_slot {
+	uint64_t key;
+	struct bucket *bucket;
 };
 
+/*
+ * State shared by every quad of a tree.
+ */
+struct tree {
+	/*
+	 * Holds the buckets and quads.
+	 */
+	struct arena arena;
+	/*
+	 * Number of cells along each side of the universe when it is a
+	 * torus. Zero when it is unbounded, and the root grows on demand.
+	 */
+	coordinate torus;
+	/*
+	 * Rule applied to the stored cells by the current step.
+	 */
+	struct rule rule;
+	/*
+	 * Generations the bucket engine advances per step, which is also
+	 * how far from a changed cell the next step may feel it.
+	 */
+	unsigned stride;
+	/*
+	 * Open addressing table of every bucket, keyed by Morton code,
+	 * with index_capacity slots of which index_count are in use.
+	 * NULL until the first bucket, or when out of memory, in which
+	 * case buckets are looked up through the quads.
+	 */
+	struct index_slot *index;
+	size_t index_capacity, index_count;
+	/*
+	 * NUMA nodes the buckets are spread over, each kept in the pool
+	 * of the arena for its node.
+	 */
+	unsigned nodes;
+	/*
+	 * Next generations of buckets seen before, or NULL to step every
+	 * bucket on the kernel.
+	 */
+	struct memo *memo;
+};
 
+/*
+ * The bounds of a quad are in buckets. They wrap around, so east may
+ * be smaller than west.
+ */
 struct quad {
 	coordinate west, east, north, south;
 	unsigned leaf, count;
 	struct quad *parent;
+	/*
+	 * Tree the quad belongs to, or NULL for a tree of fixed bounds
+	 * allocated with malloc.
+	 */
+	struct tree *tree;
+	/*
+	 * Live cells below the quad, and the smallest rectangle holding
+	 * them, in cells with both ends included. The rectangle means
+	 * nothing while population is zero. Cells are counted as they
+	 * are stored, inverted under a rule with B0 on some generations.
+	 *
+	 * update() and set() only mark the buckets they change, and the
+	 * quads above them, until census() is called.
+	 */
+	uint64_t population;
+	struct {
+		coordinate west, east, north, south;
+	} box;
+	unsigned dirty;
 	union {
 		struct {
 			struct quad *nw, *ne, *sw, *se;
@@ -60,28 +206,247 @@ struct state_change {
 	value v;
 };
 
+/*
+ * The cells of one bucket born and died in a step, as bitmaps laid out
+ * like the cells of struct bucket. x and y are in buckets.
+ */
+struct bucket_change {
+	coordinate x, y;
+	value born[BUCKETSZ * BUCKETSZ / VALUE_BIT];
+	value died[BUCKETSZ * BUCKETSZ / VALUE_BIT];
+};
+
 struct state_change_buffer {
 	unsigned length, capacity;
 	void *opaque;
 	struct state_change *items;
+	/*
+	 * Changes recorded a bucket at a time, as the bucket engines do.
+	 */
+	unsigned buckets_length, buckets_capacity;
+	struct bucket_change *buckets;
+};
+
+enum conway_engine {
+	ENGINE_BUCKET,
+	ENGINE_BUFFERED,
+	ENGINE_HASHLIFE,
+};
+
+struct conway_stats {
+	/*
+	 * Changes appended by workers to a segment of their own,
+	 * each of which would otherwise have taken the buffer's mutex.
+	 */
+	unsigned long long unlocked;
+	/*
+	 * Changes appended under the buffer's mutex.
+	 */
+	unsigned long long locked;
+	/*
+	 * Buckets stepped, and skipped because nothing around them
+	 * changed, over all steps and in the last one.
+	 */
+	unsigned long long stepped, skipped;
+	unsigned last_stepped, last_skipped;
+	/*
+	 * Buckets of those stepped whose next generation came from the
+	 * memo rather than the kernel.
+	 */
+	unsigned long long remembered;
 };
 
 struct conway {
 	struct quad *root;
 	struct state_change_buffer changes;
 	unsigned generation;
+	/*
+	 * Number of generations advanced by each step.
+	 */
+	unsigned stride;
+	enum conway_engine engine;
+	struct conway_stats stats;
+	/*
+	 * Holds every bucket and quad added to root.
+	 */
+	struct tree tree;
+	/*
+	 * Rule of the simulation, and the rule applied to the stored
+	 * cells in each phase. phase is non-zero while they are stored
+	 * inverted, which is how rules with B0 keep empty space empty.
+	 */
+	struct rule rule;
+	struct rule phases[2];
+	unsigned phase;
 	void *opaque;
 };
 
+/*
+ * Deallocates every bucket and quad below the root quad, leaving
+ * it an empty leaf when they came from an arena.
+ */
 void release(struct quad *quad);
-int conway_create(struct conway *cw, struct quad *root);
+/*
+ * Creates a simulation of the cells in root, which must be an empty
+ * leaf. When huge_pages is non-zero, the arena the quadtree grows in
+ * is backed by huge pages where the system allows it.
+ *
+ * When torus is non-zero, the universe is a torus of torus by torus
+ * cells, a multiple of BUCKETSZ no larger than COORD_MAX/2+1, and
+ * coordinates wrap around it. Otherwise the universe is unbounded:
+ * root starts out as a single bucket and grows as cells are set
+ * further away, up to COORD_MAX/2+1 cells across. Coordinates above
+ * COORD_MAX/2 are then best thought of as negative.
+ *
+ * Returns non-zero on success.
+ */
+int conway_create(struct conway *cw, struct quad *root, int huge_pages,
+                  coordinate torus);
 void conway_destroy(struct conway *cw);
+/*
+ * Spreads the buckets of cw over the NUMA nodes of topology, which
+ * must outlive cw, in squares of buckets placed in the memory of their
+ * node. Each leaf is then stepped by the workers of the node of its
+ * buckets, once the queue is pinned with workq_pin. Must be called
+ * while root is still empty.
+ *
+ * Returns non-zero on success.
+ */
+int conway_numa(struct conway *cw, const struct topology *topology);
+/*
+ * Keeps the next generations of up to entries buckets, by the cells
+ * in and around them, for the bucket engine stepping one generation
+ * at a time and the buffered engine to look up before stepping.
+ *
+ * Returns non-zero on success.
+ */
+int conway_memo(struct conway *cw, size_t entries);
+/*
+ * Moves every quad and bucket of cw into fresh slabs, one subtree
+ * after the other in Morton order, and gives the old slabs back.
+ * Buckets created or deleted over a long run end up scattered over
+ * the arena, and this puts neighbours next to each other again.
+ * Must be called between steps, and only for a root with a tree.
+ *
+ * Returns non-zero on success. On failure nothing has moved.
+ */
+int conway_relayout(struct conway *cw);
+
+/*
+ * Selects the engine computing the steps of cw, starting from the
+ * cells currently in cw->root. The bucket engine and HashLife advance
+ * 2^log_stride generations per step, the buffered engine always one.
+ * The bucket engine then steps blocks of buckets on their own for up
+ * to BUCKETSZ generations, without synchronising in between, and
+ * cannot run rules with B0.
+ *
+ * The buffered engine writes each generation straight into the back
+ * buffer of every bucket, so cw->changes only holds what update()
+ * still has to apply. Use conway_changes to get the full list.
+ *
+ * Returns non-zero on success.
+ */
+int conway_engine(struct conway *cw, enum conway_engine engine,
+                  unsigned log_stride);
+/*
+ * Makes cw follow rule from the next step on. Rules with B0 are run
+ * by storing the cells inverted on every other generation, or on all
+ * generations after the first with S8. get() and the changes see the
+ * stored cells then.
+ *
+ * Returns zero if the engine cannot run rule, or the cells are stored
+ * inverted at the moment.
+ */
+int conway_rule(struct conway *cw, const struct rule *rule);
+/*
+ * Computes the next step of cw into cw->changes, using queue to run
+ * the bucket engine in parallel. Returns once the step is complete.
+ *
+ * Returns non-zero on success.
+ */
+int conway_step(struct conway *cw, void *queue);
+/*
+ * Advances cw by generations at once, on the fastest path the engine
+ * has: HashLife jumps straight to the last generation, and the bucket
+ * engines step as many generations at a time as they can. Only the
+ * last generation is applied to cw->root. cw->changes is left empty,
+ * so anything drawn has to be drawn again from cw->root.
+ *
+ * Returns non-zero on success.
+ */
+int conway_advance(struct conway *cw, unsigned generations, void *queue);
+/*
+ * Adds every cell changed by the last step to cw->changes, if the
+ * engine did not record them already. Must be called before update().
+ */
+void conway_changes(struct conway *cw, void *queue);
 
 value get(struct quad *quad, coordinate x, coordinate y);
 void set(struct quad *quad, coordinate x, coordinate y, value v);
+/*
+ * Brings the population and bounding box of quad, and of every quad
+ * below it, up to date. Only the quads above buckets changed since the
+ * last census are looked at, and only those buckets are counted.
+ */
+void census(struct quad *quad);
+/*
+ * Replaces the cells of the bucket at bx, by, in buckets, by cells,
+ * laid out as in struct bucket. The search for the bucket starts from
+ * hint, which may be any quad of the tree.
+ *
+ * Returns the quad to start the search for the next bucket from, so
+ * that setting buckets in Morton order walks the tree little, or NULL
+ * when the bucket cannot be added.
+ */
+struct quad* set_bucket(struct quad *hint, coordinate bx, coordinate by,
+                        const value *cells);
+/*
+ * Returns the Morton code of the low 32 bits of bx and by, in which
+ * buckets close by in both directions are mostly close by.
+ */
+uint64_t morton(coordinate bx, coordinate by);
+
+int append(struct state_change_buffer *buf,
+           coordinate x, coordinate y, value v);
+int append_bucket(struct state_change_buffer *buf,
+                  const struct bucket_change *change);
+/*
+ * Replaces the bucket changes in buf by a change for every cell in
+ * them, for consumers that want single cells.
+ *
+ * Returns non-zero on success.
+ */
+int expand(struct state_change_buffer *buf);
+/*
+ * Moves the changes appended by worker threads to their own segments
+ * into the buffer itself. Must not be called while workers append.
+ *
+ * Returns the number of changes moved.
+ */
+unsigned gather(struct state_change_buffer *buf);
 
-void update(struct conway *cw);
+/*
+ * Applies the changes of the last step to cw->root, the bucket
+ * changes first.
+ *
+ * Returns zero when a bucket cannot be added, in which case some
+ * changes are lost and the generation is wrong.
+ */
+int update(struct conway *cw);
+/*
+ * As update(), splitting the changes between the workers of queue by
+ * the subtree they fall in. Adding and collecting buckets is left to
+ * the calling thread, which must not be one of the workers.
+ *
+ * Returns non-zero on success.
+ */
+int conway_update(struct conway *cw, void *queue);
 
+/*
+ * Adds work to queue computing the next generation of quad.
+ * The changes are complete once the queue is idle and they have been
+ * gathered.
+ */
 void step(struct quad *quad,
           struct state_change_buffer *changes,
           void *queue);
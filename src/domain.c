@@ -0,0 +1,598 @@
+#include <stdio.h>      /* FILE */
+
+#include "conway.h"
+#include "load.h"
+#include "domain.h"
+
+#include <stdlib.h>     /* malloc, realloc, free */
+#include <string.h>     /* memcpy, memset */
+#include <errno.h>      /* errno */
+#include <signal.h>     /* kill, SIGTERM */
+#include <fcntl.h>      /* fcntl */
+#include <poll.h>       /* poll */
+#include <unistd.h>     /* fork, read, close */
+#include <sys/socket.h> /* socketpair, send */
+#include <sys/wait.h>   /* waitpid */
+
+#define ROW_VALUES (BUCKETSZ / VALUE_BIT)
+#define CELL_VALUES (BUCKETSZ * BUCKETSZ / VALUE_BIT)
+
+/*
+ * A connection to a neighbour. Every step sends a message of one
+ * uint32_t counting the bucket changes that follow it, each way.
+ */
+struct link {
+	int fd;
+	/*
+	 * The message being sent, of which sent bytes went out.
+	 */
+	char *out;
+	size_t out_length, out_capacity, sent;
+	/*
+	 * The message being received, of which got bytes came in.
+	 * in_length is the size of the header until it is complete.
+	 */
+	char *in;
+	size_t in_length, in_capacity, got;
+};
+
+enum { WEST, EAST };
+
+struct dom {
+	struct link links[2];
+	/*
+	 * Masks of the halo columns in a row of a bucket, at the west
+	 * and the east edge.
+	 */
+	value masks[2][ROW_VALUES];
+	/*
+	 * The processes forked by the first one.
+	 */
+	pid_t *children;
+	unsigned forked;
+	coordinate torus;
+};
+
+// {{{1 strips
+
+/*
+ * Columns from b on to a, wrapping around the universe.
+ */
+static coordinate distance(struct dom *dom, coordinate a, coordinate b)
+{
+	if (!dom->torus)
+		return a - b;
+	return a >= b ? a - b : a + (dom->torus - b);
+}
+
+static coordinate move_west(struct dom *dom, coordinate a, coordinate n)
+{
+	if (!dom->torus)
+		return a - n;
+	return a >= n ? a - n : a + (dom->torus - n);
+}
+
+/*
+ * Finds the west edge of the strip of every process, in cells.
+ *
+ * Returns non-zero on success.
+ */
+static int place(coordinate *edges, unsigned processes, coordinate torus,
+                 const struct bounds *bounds)
+{
+	if (torus) {
+		coordinate columns = torus / BUCKETSZ;
+		if (columns < processes)
+			return 0;
+
+		for(unsigned i = 0; i < processes; ++i)
+			edges[i] = i * columns / processes * BUCKETSZ;
+		return 1;
+	}
+
+	coordinate first = 0;
+	coordinate last = 0;
+	if (bounds && bounds->w_set && bounds->e_set) {
+		first = bounds->west & ~(coordinate)(BUCKETSZ - 1);
+		last = bounds->east;
+	}
+
+	coordinate columns = (last - first) / BUCKETSZ + 1;
+	coordinate each = (columns + processes - 1) / processes;
+
+	// The first strip reaches around the far side of the universe.
+	edges[0] = first + (each * processes / 2) * BUCKETSZ
+	         + (COORD_MAX / 2 + 1);
+	for(unsigned i = 1; i < processes; ++i)
+		edges[i] = first + i * each * BUCKETSZ;
+	return 1;
+}
+
+/*
+ * Clears every cell of cw outside of the strip of d and its halo.
+ */
+static int trim(struct domain *d, struct dom *dom, struct conway *cw)
+{
+	coordinate west = move_west(dom, d->west, d->halo);
+	coordinate width = d->width + 2 * d->halo;
+
+	size_t length = 0, capacity = 0;
+	struct state_change *cells = NULL;
+
+	struct quad *stack[64 * 4];
+	unsigned depth = 0;
+	stack[depth++] = cw->root;
+	while(depth) {
+		struct quad *quad = stack[--depth];
+		if (!quad->leaf) {
+			for(unsigned i = 0; i < 4; ++i)
+				stack[depth++] = quad->children[i];
+			continue;
+		}
+
+		for(struct bucket *b = quad->items.head; b; b = b->next) {
+			coordinate x = b->x * BUCKETSZ;
+			coordinate y = b->y * BUCKETSZ;
+			for(unsigned i = 0; i < BUCKETSZ * BUCKETSZ; ++i) {
+				if (!((b->bucket[i / VALUE_BIT] >> (i % VALUE_BIT)) & 1))
+					continue;
+				coordinate cx = x + i % BUCKETSZ;
+				if (distance(dom, cx, west) < width)
+					continue;
+
+				if (length == capacity) {
+					capacity = capacity ? capacity * 2 : 256;
+					void *tmp = realloc(cells,
+					                    capacity * sizeof(*cells));
+					if (!tmp) {
+						free(cells);
+						return 0;
+					}
+					cells = tmp;
+				}
+				cells[length].x = cx;
+				cells[length].y = y + i / BUCKETSZ;
+				cells[length].v = 0;
+				length++;
+			}
+		}
+	}
+
+	for(size_t i = 0; i < length; ++i)
+		set(cw->root, cells[i].x, cells[i].y, 0);
+
+	free(cells);
+	return 1;
+}
+
+// 1}}}
+
+// {{{1 processes
+
+static void close_link(struct link *link)
+{
+	if (link->fd >= 0)
+		close(link->fd);
+	link->fd = -1;
+	free(link->out);
+	free(link->in);
+	link->out = NULL;
+	link->in = NULL;
+}
+
+static void kill_children(struct dom *dom)
+{
+	for(unsigned i = 0; i < dom->forked; ++i)
+		kill(dom->children[i], SIGTERM);
+}
+
+static void wait_children(struct dom *dom)
+{
+	for(unsigned i = 0; i < dom->forked; ++i)
+		while(waitpid(dom->children[i], NULL, 0) < 0 && errno == EINTR);
+	dom->forked = 0;
+}
+
+int domain_split(struct domain *d, unsigned processes, struct conway *cw,
+                 const struct bounds *bounds, unsigned halo)
+{
+	if (!processes || halo > BUCKETSZ)
+		return 0;
+
+	struct dom *dom = malloc(sizeof(struct dom));
+	if (!dom)
+		return 0;
+	memset(dom, 0, sizeof(struct dom));
+	dom->links[WEST].fd = -1;
+	dom->links[EAST].fd = -1;
+	dom->torus = cw->tree.torus;
+
+	for(unsigned i = 0; i < BUCKETSZ; ++i) {
+		value bit = 1 << (i % VALUE_BIT);
+		if (i < halo)
+			dom->masks[WEST][i / VALUE_BIT] |= bit;
+		if (i >= BUCKETSZ - halo)
+			dom->masks[EAST][i / VALUE_BIT] |= bit;
+	}
+
+	coordinate *edges = malloc(sizeof(coordinate) * processes);
+	int (*pairs)[2] = malloc(sizeof(int[2]) * processes);
+	dom->children = malloc(sizeof(pid_t) * processes);
+	if (!edges || !pairs || !dom->children
+	 || !place(edges, processes, dom->torus, bounds)) {
+		free(edges);
+		free(pairs);
+		free(dom->children);
+		free(dom);
+		return 0;
+	}
+
+	// Pair i connects the east of strip i to the west of strip i+1.
+	unsigned made = 0;
+	if (processes > 1) {
+		for(; made < processes; ++made)
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[made]) < 0)
+				break;
+	}
+
+	unsigned rank = 0;
+	int ok = processes == 1 || made == processes;
+	for(unsigned i = 1; ok && i < processes; ++i) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			ok = 0;
+		} else if (pid == 0) {
+			rank = i;
+			dom->forked = 0;
+			break;
+		} else {
+			dom->children[dom->forked++] = pid;
+		}
+	}
+
+	for(unsigned i = 0; i < made; ++i) {
+		if (ok && i == rank) {
+			dom->links[EAST].fd = pairs[i][0];
+			close(pairs[i][1]);
+		} else if (ok && (i + 1) % processes == rank) {
+			dom->links[WEST].fd = pairs[i][1];
+			close(pairs[i][0]);
+		} else {
+			close(pairs[i][0]);
+			close(pairs[i][1]);
+		}
+	}
+	for(unsigned i = 0; i < 2; ++i) {
+		int fd = dom->links[i].fd;
+		if (fd >= 0)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	d->rank = rank;
+	d->size = processes;
+	d->west = edges[rank];
+	d->width = distance(dom, edges[(rank + 1) % processes], edges[rank]);
+	if (processes == 1)
+		d->width = dom->torus ? dom->torus : 0;
+	d->halo = halo;
+	d->opaque = dom;
+
+	free(edges);
+	free(pairs);
+
+	if (!ok) {
+		wait_children(dom);
+		domain_destroy(d);
+		return 0;
+	}
+
+	// A single strip is the whole universe, and has nothing to trim.
+	if (processes > 1 && !trim(d, dom, cw)) {
+		// Neighbours stop when their links close, the first process
+		// does not wait for that.
+		kill_children(dom);
+		domain_destroy(d);
+		return 0;
+	}
+	return 1;
+}
+
+void domain_destroy(struct domain *d)
+{
+	struct dom *dom = d->opaque;
+	if (!dom)
+		return;
+
+	close_link(dom->links + WEST);
+	close_link(dom->links + EAST);
+	wait_children(dom);
+
+	free(dom->children);
+	free(dom);
+	d->opaque = NULL;
+}
+
+// 1}}}
+
+// {{{1 exchange
+
+static int reserve(char **buf, size_t *capacity, size_t size)
+{
+	if (size <= *capacity)
+		return 1;
+
+	size_t new_cap = *capacity ? *capacity : 4096;
+	while(new_cap < size)
+		new_cap *= 2;
+
+	void *tmp = realloc(*buf, new_cap);
+	if (!tmp)
+		return 0;
+	*buf = tmp;
+	*capacity = new_cap;
+	return 1;
+}
+
+/*
+ * Adds the cells of c under mask to the message for link, unless
+ * there are none.
+ */
+static int queue(struct link *link, const struct bucket_change *c,
+                 const value *mask)
+{
+	struct bucket_change out;
+	out.x = c->x;
+	out.y = c->y;
+
+	value any = 0;
+	for(unsigned i = 0; i < CELL_VALUES; ++i) {
+		out.born[i] = c->born[i] & mask[i % ROW_VALUES];
+		out.died[i] = c->died[i] & mask[i % ROW_VALUES];
+		any |= out.born[i] | out.died[i];
+	}
+	if (!any)
+		return 1;
+
+	if (!reserve(&link->out, &link->out_capacity,
+	             link->out_length + sizeof(out)))
+		return 0;
+	memcpy(link->out + link->out_length, &out, sizeof(out));
+	link->out_length += sizeof(out);
+	return 1;
+}
+
+static int sending(struct link *link)
+{
+	return link->fd >= 0 && link->sent < link->out_length;
+}
+
+static int receiving(struct link *link)
+{
+	return link->fd >= 0 && link->got < link->in_length;
+}
+
+static int send_some(struct link *link)
+{
+	ssize_t n = send(link->fd, link->out + link->sent,
+	                 link->out_length - link->sent, MSG_NOSIGNAL);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+	link->sent += n;
+	return 1;
+}
+
+static int receive_some(struct link *link)
+{
+	ssize_t n = read(link->fd, link->in + link->got,
+	                 link->in_length - link->got);
+	if (n == 0)
+		return 0;
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+	link->got += n;
+	if (link->got == sizeof(uint32_t)
+	 && link->in_length == sizeof(uint32_t)) {
+		uint32_t count;
+		memcpy(&count, link->in, sizeof(count));
+
+		link->in_length += count * sizeof(struct bucket_change);
+		if (!reserve(&link->in, &link->in_capacity, link->in_length))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sends the message of each link while receiving the one coming back,
+ * so neither side blocks on a full socket.
+ */
+static int transfer(struct link *links)
+{
+	for(unsigned i = 0; i < 2; ++i) {
+		struct link *l = links + i;
+		uint32_t count = (l->out_length - sizeof(uint32_t))
+		               / sizeof(struct bucket_change);
+		memcpy(l->out, &count, sizeof(count));
+		l->sent = 0;
+		l->in_length = sizeof(uint32_t);
+		l->got = 0;
+	}
+
+	for(;;) {
+		struct pollfd fds[2];
+		for(unsigned i = 0; i < 2; ++i) {
+			fds[i].fd = links[i].fd;
+			fds[i].events = (sending(links + i) ? POLLOUT : 0)
+			              | (receiving(links + i) ? POLLIN : 0);
+			fds[i].revents = 0;
+			if (!fds[i].events)
+				fds[i].fd = -1;
+		}
+		if (fds[WEST].fd < 0 && fds[EAST].fd < 0)
+			return 1;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+
+		for(unsigned i = 0; i < 2; ++i) {
+			short ev = fds[i].revents;
+			if ((ev & POLLOUT) && !send_some(links + i))
+				return 0;
+			if ((ev & (POLLIN | POLLHUP | POLLERR))
+			 && receiving(links + i) && !receive_some(links + i))
+				return 0;
+			if ((ev & (POLLHUP | POLLERR)) && !(ev & POLLIN))
+				return 0;
+		}
+	}
+}
+
+int domain_exchange(struct domain *d, struct conway *cw)
+{
+	struct dom *dom = d->opaque;
+	if (d->size == 1)
+		return 1;
+
+	struct link *links = dom->links;
+	for(unsigned i = 0; i < 2; ++i) {
+		links[i].out_length = sizeof(uint32_t);
+		if (!reserve(&links[i].out, &links[i].out_capacity,
+		             links[i].out_length)
+		 || !reserve(&links[i].in, &links[i].in_capacity,
+		             sizeof(uint32_t)))
+			return 0;
+	}
+
+	// Keep the changes to the strip, and pass on those at its edges.
+	struct state_change_buffer *changes = &cw->changes;
+	unsigned kept = 0;
+	for(unsigned i = 0; i < changes->buckets_length; ++i) {
+		struct bucket_change *c = changes->buckets + i;
+		coordinate offset = distance(dom, c->x * BUCKETSZ, d->west);
+		if (offset >= d->width)
+			continue;
+
+		if (offset == 0 && !queue(links + WEST, c, dom->masks[WEST]))
+			return 0;
+		if (offset == d->width - BUCKETSZ
+		 && !queue(links + EAST, c, dom->masks[EAST]))
+			return 0;
+
+		if (kept != i)
+			changes->buckets[kept] = *c;
+		kept++;
+	}
+	changes->buckets_length = kept;
+
+	if (!transfer(links))
+		return 0;
+
+	for(unsigned i = 0; i < 2; ++i) {
+		const char *p = links[i].in + sizeof(uint32_t);
+		const char *end = links[i].in + links[i].in_length;
+		for(; p < end; p += sizeof(struct bucket_change)) {
+			struct bucket_change c;
+			memcpy(&c, p, sizeof(c));
+			if (!append_bucket(changes, &c))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// 1}}}
+
+// {{{1 gather
+
+/*
+ * Adds every bucket below quad in the strip of d to the message for
+ * link, its cells as births.
+ */
+static int queue_strip(struct domain *d, struct dom *dom, struct link *link,
+                       struct quad *quad)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i) {
+			if (!queue_strip(d, dom, link, quad->children[i]))
+				return 0;
+		}
+		return 1;
+	}
+
+	for(struct bucket *b = quad->items.head; b; b = b->next) {
+		if (distance(dom, b->x * BUCKETSZ, d->west) >= d->width)
+			continue;
+
+		struct bucket_change c;
+		c.x = b->x;
+		c.y = b->y;
+		memcpy(c.born, b->bucket, sizeof(c.born));
+		memset(c.died, 0, sizeof(c.died));
+
+		if (!reserve(&link->out, &link->out_capacity,
+		             link->out_length + sizeof(c)))
+			return 0;
+		memcpy(link->out + link->out_length, &c, sizeof(c));
+		link->out_length += sizeof(c);
+	}
+	return 1;
+}
+
+int domain_gather(struct domain *d, struct conway *cw)
+{
+	struct dom *dom = d->opaque;
+	if (d->size == 1)
+		return 1;
+
+	struct link *links = dom->links;
+	for(unsigned i = 0; i < 2; ++i) {
+		links[i].out_length = sizeof(uint32_t);
+		if (!reserve(&links[i].out, &links[i].out_capacity,
+		             links[i].out_length)
+		 || !reserve(&links[i].in, &links[i].in_capacity,
+		             sizeof(uint32_t)))
+			return 0;
+	}
+
+	// Every round passes each strip one process further west, until
+	// the first process has them all. It sends nothing itself.
+	if (d->rank && !queue_strip(d, dom, links + WEST, cw->root))
+		return 0;
+
+	struct quad *hint = cw->root;
+	for(unsigned round = 1; round < d->size; ++round) {
+		if (!transfer(links))
+			return 0;
+
+		links[WEST].out_length = sizeof(uint32_t);
+		links[EAST].out_length = sizeof(uint32_t);
+
+		const char *p = links[EAST].in + sizeof(uint32_t);
+		const char *end = links[EAST].in + links[EAST].in_length;
+		for(; p < end; p += sizeof(struct bucket_change)) {
+			struct bucket_change c;
+			memcpy(&c, p, sizeof(c));
+			if (d->rank == 0) {
+				hint = set_bucket(hint, c.x, c.y, c.born);
+				if (!hint)
+					return 0;
+				continue;
+			}
+
+			struct link *west = links + WEST;
+			if (!reserve(&west->out, &west->out_capacity,
+			             west->out_length + sizeof(c)))
+				return 0;
+			memcpy(west->out + west->out_length, &c, sizeof(c));
+			west->out_length += sizeof(c);
+		}
+	}
+	return 1;
+}
+
+// 1}}}
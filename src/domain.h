@@ -0,0 +1,65 @@
+
+/*
+ * One of several processes sharing a universe, each of which owns
+ * the cells in a strip of columns. A process keeps a halo of the
+ * columns its neighbours own next to the strip, as wide as the
+ * number of generations in a step, so that it can step its own
+ * cells on its own.
+ */
+struct domain {
+	/*
+	 * Number of the process, from zero, and of processes.
+	 */
+	unsigned rank, size;
+	/*
+	 * The strip owned by the process: width columns of cells from
+	 * west on, wrapping around. Both are multiples of BUCKETSZ.
+	 */
+	coordinate west, width;
+	/*
+	 * Columns of the halo on either side of the strip.
+	 */
+	unsigned halo;
+	void *opaque;
+};
+
+/*
+ * Splits the universe of cw into processes strips, forking a process
+ * for every strip but the first. Returns in every process, which then
+ * owns the strip given by d, with cw holding only the cells of the
+ * strip and its halo. halo must be at most BUCKETSZ.
+ *
+ * A torus is split into strips of equal width. An unbounded universe
+ * is split across the columns from bounds, the outermost strips also
+ * taking in all of the universe beyond them.
+ *
+ * Returns non-zero on success. On failure the processes already forked
+ * have been waited for.
+ */
+int domain_split(struct domain *d, unsigned processes, struct conway *cw,
+                 const struct bounds *bounds, unsigned halo);
+/*
+ * Closes the connections to the neighbours. The first process then
+ * waits for all of the others to exit.
+ */
+void domain_destroy(struct domain *d);
+
+/*
+ * Exchanges the changes of the last step of cw at the edges of the
+ * strip with the neighbours, after conway_step and before update().
+ * Drops the changes outside of the strip from cw->changes, and adds
+ * the changes the neighbours made to the halo.
+ *
+ * Only the bucket engine is supported.
+ *
+ * Returns non-zero on success, zero when a neighbour went away.
+ */
+int domain_exchange(struct domain *d, struct conway *cw);
+/*
+ * Sends the cells of the strip of every process to the first one,
+ * which then holds the whole universe, halos included, and may no
+ * longer exchange. Every process must call it at the same generation.
+ *
+ * Returns non-zero on success.
+ */
+int domain_gather(struct domain *d, struct conway *cw);
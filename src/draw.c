@@ -115,8 +115,8 @@ enum draw_update_result draw_update(struct draw *draw)
 				              - x * (int)draw->view.scale;
 				d->yrelacc = e.motion.yrel + d->yrelacc 
 				              - y * (int)draw->view.scale;
-				draw->view.x = (int)draw->view.x - x;
-				draw->view.y = (int)draw->view.y - y;
+				draw->view.x -= x;
+				draw->view.y -= y;
 				d->dirty = 1;
 			}
 			break;
@@ -135,6 +135,34 @@ enum draw_update_result draw_update(struct draw *draw)
 }
 
 
+/*
+ * Clips the len cells from from onward to the extent cells of the view
+ * starting at origin. Coordinates wrap around, so a span just before
+ * the view is not mistaken for one far after it.
+ *
+ * Returns zero when nothing of the span is visible.
+ */
+static int clip(coordinate from, coordinate len,
+                coordinate origin, coordinate extent, int *pos, int *size)
+{
+	int64_t start = (int64_t)(from - origin);
+	if (start >= (int64_t)extent)
+		return 0;
+
+	if (start < 0) {
+		coordinate skip = (coordinate)0 - (coordinate)start;
+		if (len <= skip)
+			return 0;
+		len -= skip;
+		start = 0;
+	}
+	if (len > extent - start)
+		len = extent - start;
+
+	*pos = start;
+	*size = len;
+	return 1;
+}
 
 static void dbg_draw(struct draw *d, struct draw_data *data,
                      struct quad *quad, unsigned depth)
@@ -154,10 +182,12 @@ static void dbg_draw(struct draw *d, struct draw_data *data,
 	unsigned color_sz = sizeof(colors)/sizeof(colors[0]);
 
 	SDL_Rect r, b;
-	r.x = (coordinate)(quad->west * BUCKETSZ - d->view.x);
-	r.y = (coordinate)(quad->north * BUCKETSZ - d->view.y);
-	r.w = (quad->east  - quad->west) * BUCKETSZ;
-	r.h = (quad->south - quad->north) * BUCKETSZ;
+	if (!clip(quad->west * BUCKETSZ, (quad->east - quad->west) * BUCKETSZ,
+	          d->view.x, d->view.w, &r.x, &r.w))
+		return;
+	if (!clip(quad->north * BUCKETSZ, (quad->south - quad->north) * BUCKETSZ,
+	          d->view.y, d->view.h, &r.y, &r.h))
+		return;
 	r.x *= d->view.scale;
 	r.y *= d->view.scale;
 	r.w *= d->view.scale;
@@ -176,14 +206,19 @@ static void dbg_draw(struct draw *d, struct draw_data *data,
 		struct bucket *cur = quad->items.head;
 		while(cur != NULL) {
 
-			r.x = (coordinate)(cur->x * BUCKETSZ - d->view.x);
-			r.x *= d->view.scale;
-			r.y = (coordinate)(cur->y * BUCKETSZ - d->view.y);
-			r.y *= d->view.scale;
-			r.w = BUCKETSZ * d->view.scale;
-			r.h = BUCKETSZ * d->view.scale;
+			int visible =
+			    clip(cur->x * BUCKETSZ, BUCKETSZ,
+			         d->view.x, d->view.w, &r.x, &r.w)
+			 && clip(cur->y * BUCKETSZ, BUCKETSZ,
+			         d->view.y, d->view.h, &r.y, &r.h);
+			if (visible) {
+				r.x *= d->view.scale;
+				r.y *= d->view.scale;
+				r.w *= d->view.scale;
+				r.h *= d->view.scale;
+			}
 
-			if (SDL_IntersectRect(&r, &scbounds, &b)) {
+			if (visible && SDL_IntersectRect(&r, &scbounds, &b)) {
 				struct sdlcol c = colors[cur->num % color_sz];
 				Uint32 clr = SDL_MapRGB(screen->format,
 			                                c.r, c.g, c.b);
@@ -197,6 +232,59 @@ static void dbg_draw(struct draw *d, struct draw_data *data,
 	}
 }
 
+/*
+ * Paints the cell at x, y in color, if it is in view.
+ */
+static void draw_cell(struct draw *d, SDL_Surface *screen,
+                      coordinate x, coordinate y, Uint32 color)
+{
+	coordinate scx = x - d->view.x;
+	coordinate scy = y - d->view.y;
+	if (scx >= d->view.w || scy >= d->view.h)
+		return;
+
+	SDL_Rect r, b;
+	r.x = scx * d->view.scale;
+	r.y = scy * d->view.scale;
+	r.w = d->view.scale;
+	r.h = d->view.scale;
+
+	SDL_Rect screen_bounds = { 0, 0, screen->w, screen->h };
+	if (SDL_IntersectRect(&r, &screen_bounds, &b))
+		SDL_FillRect(screen, &b, color);
+}
+
+/*
+ * Paints the cells born and died in a bucket change, skipping the
+ * bucket at once when it is out of view.
+ */
+static void draw_bucket(struct draw *d, SDL_Surface *screen,
+                        const struct bucket_change *c, Uint32 on, Uint32 off)
+{
+	int pos, size;
+	if (!clip(c->x * BUCKETSZ, BUCKETSZ, d->view.x, d->view.w, &pos, &size)
+	 || !clip(c->y * BUCKETSZ, BUCKETSZ, d->view.y, d->view.h, &pos, &size))
+		return;
+
+	for(unsigned i = 0; i < BUCKETSZ * BUCKETSZ / VALUE_BIT; ++i) {
+		value any = c->born[i] | c->died[i];
+		for(unsigned k = 0; any; ++k, any >>= 1) {
+			if (!(any & 1))
+				continue;
+
+			coordinate cell = i * VALUE_BIT + k;
+			draw_cell(d, screen, c->x * BUCKETSZ + cell % BUCKETSZ,
+			                     c->y * BUCKETSZ + cell / BUCKETSZ,
+			          (c->born[i] >> k) & 1 ? on : off);
+		}
+	}
+}
+
+int draw_needs_tree(struct draw *d)
+{
+	struct draw_data *data = d->opaque;
+	return data->dirty || d->dbg;
+}
 
 void draw(struct draw *d, struct quad *quad,
           struct state_change_buffer *changes)
@@ -204,7 +292,8 @@ void draw(struct draw *d, struct quad *quad,
 	struct draw_data *data = d->opaque;
 	SDL_Surface *screen = data->screen;
 
-	if (quad->count == 0)
+	int whole = draw_needs_tree(d);
+	if (whole && quad->count == 0)
 		return;
 
 	if (screen->w <= 0 || screen->h <= 0)
@@ -222,7 +311,7 @@ void draw(struct draw *d, struct quad *quad,
 	SDL_Rect screen_bounds = { 0, 0, screen->w, screen->h };
 	SDL_Rect r, b;
 
-	if (data->dirty || d->dbg) {
+	if (whole) {
 		(void)(changes);
 
 		SDL_FillRect(screen, &screen_bounds, off);
@@ -251,23 +340,12 @@ void draw(struct draw *d, struct quad *quad,
 
 		data->dirty = 0;
 	} else {
-		for(unsigned i = 0; i < changes->length; ++i) {
-			struct state_change c = changes->items[i]; 
+		for(unsigned i = 0; i < changes->buckets_length; ++i)
+			draw_bucket(d, screen, changes->buckets + i, on, off);
 
-			coordinate scx = c.x-d->view.x;
-			coordinate scy = c.y-d->view.y;
-
-			int x = scx * d->view.scale;
-			int y = scy * d->view.scale;
-
-			SDL_Rect r;
-			r.x = x;
-			r.y = y;
-			r.w = d->view.scale;
-			r.h = d->view.scale;
-
-			if (SDL_IntersectRect(&r, &screen_bounds, &b))
-				SDL_FillRect(screen, &b, c.v ? on : off);
+		for(unsigned i = 0; i < changes->length; ++i) {
+			struct state_change c = changes->items[i];
+			draw_cell(d, screen, c.x, c.y, c.v ? on : off);
 		}
 	}
 
@@ -11,8 +11,17 @@ struct draw {
 int  draw_create(struct draw *d);
 void draw_destroy(struct draw *d);
 
+/*
+ * Paints the cells of changes, or the whole view from quad when it has
+ * moved. Only the latter reads quad.
+ */
 void draw(struct draw *d, struct quad *quad,
           struct state_change_buffer *changes);
+/*
+ * Returns non-zero when the next draw() paints the whole view, reading
+ * quad, rather than just the changes.
+ */
+int draw_needs_tree(struct draw *d);
 
 enum draw_update_result {
 	DR_OK,
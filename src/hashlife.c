@@ -0,0 +1,662 @@
+#include "conway.h"
+#include "hashlife.h"
+
+#include <stdlib.h> /* malloc, calloc, free */
+#include <assert.h> /* assert */
+
+/*
+ * A square of 2^level cells on each side. Nodes are canonical: two
+ * nodes with the same contents are the same node, so equal regions
+ * can be compared, and their futures shared, by pointer.
+ */
+struct node {
+	struct node *nw, *ne, *sw, *se;
+	struct node *next;   // Hash chain, or free list
+	struct node *result; // Centre of the node, log_stride generations on
+	uint64_t population;
+	unsigned level;
+	unsigned mark;
+};
+
+#define NODE_BLOCK 4096
+#define MAX_LEVEL 64
+#define GC_MIN (1u << 20)
+
+struct node_block {
+	struct node_block *next;
+	struct node items[NODE_BLOCK];
+};
+
+struct hl {
+	struct {
+		unsigned length, count;
+		struct node **items;
+	} table;
+	struct {
+		struct node_block *head;
+		unsigned used;
+		struct node *free;
+	} blocks;
+	unsigned gc_limit, epoch;
+
+	struct node cells[2];
+	struct node *empty[MAX_LEVEL];
+
+	// Always centred on the origin
+	struct node *root;
+	// Root as of the last changes handed out, while hashlife_advance
+	// runs, so that collect keeps it
+	struct node *from;
+	unsigned log_stride;
+	struct rule rule;
+};
+
+// {{{1 node table
+
+static uint64_t hash(struct node *nw, struct node *ne,
+                     struct node *sw, struct node *se)
+{
+	uint64_t h = (uintptr_t)nw;
+	h = h * 0x9e3779b97f4a7c15ull + (uintptr_t)ne;
+	h = h * 0x9e3779b97f4a7c15ull + (uintptr_t)sw;
+	h = h * 0x9e3779b97f4a7c15ull + (uintptr_t)se;
+	return h ^ (h >> 32);
+}
+
+static struct node* alloc_node(struct hl *hl)
+{
+	struct node *n = hl->blocks.free;
+	if (n) {
+		hl->blocks.free = n->next;
+		return n;
+	}
+
+	if (!hl->blocks.head || hl->blocks.used == NODE_BLOCK) {
+		struct node_block *b = malloc(sizeof(struct node_block));
+		if (!b)
+			return NULL;
+		b->next = hl->blocks.head;
+		hl->blocks.head = b;
+		hl->blocks.used = 0;
+	}
+
+	return hl->blocks.head->items + hl->blocks.used++;
+}
+
+static void grow_table(struct hl *hl)
+{
+	unsigned length = hl->table.length * 2;
+	struct node **items = calloc(length, sizeof(struct node*));
+	if (!items)
+		return; // Keep going with longer chains
+
+	for(unsigned i = 0; i < hl->table.length; ++i) {
+		struct node *cur = hl->table.items[i];
+		while(cur) {
+			struct node *n = cur;
+			cur = cur->next;
+
+			uint64_t h = hash(n->nw, n->ne, n->sw, n->se);
+			n->next = items[h & (length - 1)];
+			items[h & (length - 1)] = n;
+		}
+	}
+
+	free(hl->table.items);
+	hl->table.items = items;
+	hl->table.length = length;
+}
+
+/*
+ * Returns the canonical node with the given quadrants, or NULL if it
+ * cannot be allocated or any quadrant is NULL.
+ */
+static struct node* join(struct hl *hl,
+                         struct node *nw, struct node *ne,
+                         struct node *sw, struct node *se)
+{
+	if (!nw || !ne || !sw || !se)
+		return NULL;
+
+	assert(nw->level == ne->level);
+	assert(nw->level == sw->level);
+	assert(nw->level == se->level);
+
+	uint64_t h = hash(nw, ne, sw, se);
+	struct node **slot = hl->table.items + (h & (hl->table.length - 1));
+
+	for(struct node *cur = *slot; cur; cur = cur->next) {
+		if (cur->nw == nw && cur->ne == ne
+		 && cur->sw == sw && cur->se == se)
+			return cur;
+	}
+
+	struct node *n = alloc_node(hl);
+	if (!n)
+		return NULL;
+
+	n->nw = nw;
+	n->ne = ne;
+	n->sw = sw;
+	n->se = se;
+	n->result = NULL;
+	n->population = nw->population + ne->population
+	              + sw->population + se->population;
+	n->level = nw->level + 1;
+	n->mark = hl->epoch;
+
+	n->next = *slot;
+	*slot = n;
+
+	if (++hl->table.count > hl->table.length)
+		grow_table(hl);
+
+	return n;
+}
+
+static struct node* empty(struct hl *hl, unsigned level)
+{
+	assert(level < MAX_LEVEL);
+
+	if (!hl->empty[level]) {
+		struct node *e = empty(hl, level - 1);
+		hl->empty[level] = join(hl, e, e, e, e);
+	}
+	return hl->empty[level];
+}
+
+// 1}}}
+
+// {{{1 garbage collection
+
+static void mark(struct hl *hl, struct node *n)
+{
+	if (!n || n->level == 0 || n->mark == hl->epoch)
+		return;
+
+	n->mark = hl->epoch;
+	mark(hl, n->nw);
+	mark(hl, n->ne);
+	mark(hl, n->sw);
+	mark(hl, n->se);
+}
+
+/*
+ * Frees every node not reachable from the root once the table has
+ * grown past its limit. Memoised results survive only if the node
+ * they point to does.
+ */
+static void collect(struct hl *hl)
+{
+	if (hl->table.count < hl->gc_limit)
+		return;
+
+	hl->epoch++;
+	mark(hl, hl->root);
+	mark(hl, hl->from);
+	for(unsigned i = 0; i < MAX_LEVEL; ++i)
+		mark(hl, hl->empty[i]);
+
+	for(unsigned i = 0; i < hl->table.length; ++i) {
+		struct node **cur = hl->table.items + i;
+		while(*cur) {
+			struct node *n = *cur;
+			if (n->mark == hl->epoch) {
+				cur = &n->next;
+				continue;
+			}
+
+			*cur = n->next;
+			n->mark = 0;
+			n->next = hl->blocks.free;
+			hl->blocks.free = n;
+			hl->table.count--;
+		}
+	}
+
+	for(unsigned i = 0; i < hl->table.length; ++i) {
+		for(struct node *n = hl->table.items[i]; n; n = n->next) {
+			if (n->result && n->result->mark != hl->epoch)
+				n->result = NULL;
+		}
+	}
+
+	hl->gc_limit = hl->table.count * 2;
+	if (hl->gc_limit < GC_MIN)
+		hl->gc_limit = GC_MIN;
+}
+
+// 1}}}
+
+// {{{1 successor
+
+/*
+ * Steps a 4x4 node one generation, returning its 2x2 centre.
+ */
+static struct node* base(struct hl *hl, struct node *n)
+{
+	assert(n->level == 2);
+
+	// Bit y*4 + x holds the cell at x, y
+	unsigned bits = 0;
+	struct node *quadrant[4] = { n->nw, n->ne, n->sw, n->se };
+	for(unsigned i = 0; i < 4; ++i) {
+		struct node *q = quadrant[i];
+		struct node *cell[4] = { q->nw, q->ne, q->sw, q->se };
+		unsigned ox = (i & 1) * 2, oy = (i >> 1) * 2;
+
+		for(unsigned j = 0; j < 4; ++j) {
+			if (cell[j]->population)
+				bits |= 1u << ((oy + (j >> 1)) * 4 + ox + (j & 1));
+		}
+	}
+
+	struct node *out[4];
+	for(unsigned i = 0; i < 4; ++i) {
+		unsigned x = 1 + (i & 1), y = 1 + (i >> 1);
+
+		unsigned count = 0;
+		for(unsigned ny = y - 1; ny <= y + 1; ++ny) {
+			for(unsigned nx = x - 1; nx <= x + 1; ++nx)
+				count += (bits >> (ny * 4 + nx)) & 1;
+		}
+
+		unsigned alive = (bits >> (y * 4 + x)) & 1;
+		count -= alive;
+
+		unsigned table = alive ? hl->rule.survive : hl->rule.born;
+		out[i] = &hl->cells[(table >> count) & 1];
+	}
+
+	return join(hl, out[0], out[1], out[2], out[3]);
+}
+
+/*
+ * Returns the centre of n, advanced 2^min(log_stride, level-2)
+ * generations.
+ */
+static struct node* successor(struct hl *hl, struct node *n)
+{
+	if (!n)
+		return NULL;
+
+	assert(n->level >= 2);
+
+	if (n->result)
+		return n->result;
+
+	if (n->population == 0) {
+		n->result = empty(hl, n->level - 1);
+		return n->result;
+	}
+
+	if (n->level == 2) {
+		n->result = base(hl, n);
+		return n->result;
+	}
+
+	struct node *nw = n->nw, *ne = n->ne, *sw = n->sw, *se = n->se;
+
+	// Nine overlapping subnodes, stepped to the same point in time
+	struct node *c[9] = {
+		successor(hl, nw),
+		successor(hl, join(hl, nw->ne, ne->nw, nw->se, ne->sw)),
+		successor(hl, ne),
+		successor(hl, join(hl, nw->sw, nw->se, sw->nw, sw->ne)),
+		successor(hl, join(hl, nw->se, ne->sw, sw->ne, se->nw)),
+		successor(hl, join(hl, ne->sw, ne->se, se->nw, se->ne)),
+		successor(hl, sw),
+		successor(hl, join(hl, sw->ne, se->nw, sw->se, se->sw)),
+		successor(hl, se),
+	};
+
+	for(unsigned i = 0; i < 9; ++i) {
+		if (!c[i])
+			return NULL;
+	}
+
+	if (hl->log_stride < n->level - 2) {
+		// The subnodes are as far ahead as wanted, take their centres
+		n->result = join(hl,
+			join(hl, c[0]->se, c[1]->sw, c[3]->ne, c[4]->nw),
+			join(hl, c[1]->se, c[2]->sw, c[4]->ne, c[5]->nw),
+			join(hl, c[3]->se, c[4]->sw, c[6]->ne, c[7]->nw),
+			join(hl, c[4]->se, c[5]->sw, c[7]->ne, c[8]->nw));
+	} else {
+		// Halfway there, step the four overlapping quadrants again
+		n->result = join(hl,
+			successor(hl, join(hl, c[0], c[1], c[3], c[4])),
+			successor(hl, join(hl, c[1], c[2], c[4], c[5])),
+			successor(hl, join(hl, c[3], c[4], c[6], c[7])),
+			successor(hl, join(hl, c[4], c[5], c[7], c[8])));
+	}
+
+	return n->result;
+}
+
+/*
+ * Surrounds n with empty space, keeping its centre in place.
+ */
+static struct node* pad(struct hl *hl, struct node *n)
+{
+	if (!n)
+		return NULL;
+
+	struct node *e = empty(hl, n->level - 1);
+	return join(hl, join(hl, e, e, e, n->nw),
+	                join(hl, e, e, n->ne, e),
+	                join(hl, e, n->sw, e, e),
+	                join(hl, n->se, e, e, e));
+}
+
+/*
+ * Non-zero if every live cell in n is within its centre's centre.
+ */
+static int is_padded(struct node *n)
+{
+	assert(n->level >= 3);
+
+	return n->population == n->nw->se->se->population
+	                      + n->ne->sw->sw->population
+	                      + n->sw->ne->ne->population
+	                      + n->se->nw->nw->population;
+}
+
+// 1}}}
+
+// {{{1 conversion
+
+static int64_t plane(coordinate c)
+{
+	if (c > COORD_MAX / 2)
+		return -(int64_t)(COORD_MAX - c) - 1;
+	return c;
+}
+
+static struct node* build(struct hl *hl, struct bucket *bucket,
+                          unsigned x, unsigned y, unsigned level)
+{
+	if (level == 0) {
+		unsigned i = x + y * BUCKETSZ;
+		value v = bucket->bucket[i / VALUE_BIT] >> (i % VALUE_BIT);
+		return &hl->cells[v & 1];
+	}
+
+	unsigned half = 1u << (level - 1);
+	return join(hl, build(hl, bucket, x,        y,        level - 1),
+	                build(hl, bucket, x + half, y,        level - 1),
+	                build(hl, bucket, x,        y + half, level - 1),
+	                build(hl, bucket, x + half, y + half, level - 1));
+}
+
+/*
+ * Replaces the part of n at x, y relative to its top left corner
+ * with sub.
+ */
+static struct node* insert(struct hl *hl, struct node *n,
+                           uint64_t x, uint64_t y, struct node *sub)
+{
+	if (!n || !sub)
+		return NULL;
+
+	if (n->level == sub->level)
+		return sub;
+
+	uint64_t half = (uint64_t)1 << (n->level - 1);
+	struct node *nw = n->nw, *ne = n->ne, *sw = n->sw, *se = n->se;
+
+	if (y < half) {
+		if (x < half)
+			nw = insert(hl, nw, x, y, sub);
+		else
+			ne = insert(hl, ne, x - half, y, sub);
+	} else {
+		if (x < half)
+			sw = insert(hl, sw, x, y - half, sub);
+		else
+			se = insert(hl, se, x - half, y - half, sub);
+	}
+
+	return join(hl, nw, ne, sw, se);
+}
+
+static int64_t extent(struct quad *quad)
+{
+	int64_t max = 0;
+
+	if (quad->leaf) {
+		for(struct bucket *cur = quad->items.head; cur; cur = cur->next) {
+			int64_t x = plane((coordinate)(cur->x * BUCKETSZ));
+			int64_t y = plane((coordinate)(cur->y * BUCKETSZ));
+			if (x < 0) x = -x;
+			if (y < 0) y = -y;
+			if (x > max) max = x;
+			if (y > max) max = y;
+		}
+	} else {
+		for(unsigned i = 0; i < 4; ++i) {
+			int64_t e = extent(quad->children[i]);
+			if (e > max)
+				max = e;
+		}
+	}
+	return max;
+}
+
+static int load(struct hl *hl, struct quad *quad, unsigned bucket_level)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i) {
+			if (!load(hl, quad->children[i], bucket_level))
+				return 0;
+		}
+		return 1;
+	}
+
+	uint64_t half = (uint64_t)1 << (hl->root->level - 1);
+
+	for(struct bucket *cur = quad->items.head; cur; cur = cur->next) {
+		int64_t x = plane((coordinate)(cur->x * BUCKETSZ));
+		int64_t y = plane((coordinate)(cur->y * BUCKETSZ));
+
+		struct node *sub = build(hl, cur, 0, 0, bucket_level);
+		hl->root = insert(hl, hl->root, x + half, y + half, sub);
+		if (!hl->root)
+			return 0;
+	}
+	return 1;
+}
+
+static int diff(struct hl *hl, struct node *a, struct node *b,
+                int64_t x, int64_t y, struct state_change_buffer *changes)
+{
+	if (a == b)
+		return 1;
+
+	if (a->level == 0)
+		return append(changes, (coordinate)x, (coordinate)y,
+		              b->population != 0);
+
+	int64_t half = (int64_t)1 << (a->level - 1);
+	return diff(hl, a->nw, b->nw, x,        y,        changes)
+	    && diff(hl, a->ne, b->ne, x + half, y,        changes)
+	    && diff(hl, a->sw, b->sw, x,        y + half, changes)
+	    && diff(hl, a->se, b->se, x + half, y + half, changes);
+}
+
+// 1}}}
+
+int hashlife_create(struct hashlife *hashlife, struct quad *quad,
+                    unsigned log_stride, const struct rule *rule)
+{
+	if (!hashlife) return 0;
+	if (!quad) return 0;
+	if (!rule || (rule->born & 1)) return 0;
+
+	struct hl *hl = malloc(sizeof(struct hl));
+	hashlife->opaque = hl;
+	if (!hl)
+		return 0;
+
+	hl->table.length = 1 << 16;
+	hl->table.count = 0;
+	hl->table.items = calloc(hl->table.length, sizeof(struct node*));
+	hl->blocks.head = NULL;
+	hl->blocks.used = 0;
+	hl->blocks.free = NULL;
+	hl->gc_limit = GC_MIN;
+	hl->epoch = 1;
+	hl->log_stride = log_stride;
+	hl->rule = *rule;
+	hl->from = NULL;
+
+	for(unsigned i = 0; i < 2; ++i) {
+		hl->cells[i].nw = NULL;
+		hl->cells[i].ne = NULL;
+		hl->cells[i].sw = NULL;
+		hl->cells[i].se = NULL;
+		hl->cells[i].next = NULL;
+		hl->cells[i].result = NULL;
+		hl->cells[i].population = i;
+		hl->cells[i].level = 0;
+		hl->cells[i].mark = 0;
+	}
+	for(unsigned i = 0; i < MAX_LEVEL; ++i)
+		hl->empty[i] = NULL;
+	hl->empty[0] = &hl->cells[0];
+
+	if (!hl->table.items)
+		goto exit;
+
+	unsigned bucket_level = 0;
+	while((1u << bucket_level) < BUCKETSZ)
+		bucket_level++;
+
+	unsigned level = bucket_level + 1;
+	int64_t max = extent(quad) + BUCKETSZ;
+	while(level < 3 || ((int64_t)1 << (level - 1)) < max)
+		level++;
+
+	hl->root = empty(hl, level);
+	if (!hl->root || !load(hl, quad, bucket_level))
+		goto exit;
+
+	return 1;
+exit:
+	hashlife_destroy(hashlife);
+	return 0;
+}
+
+void hashlife_destroy(struct hashlife *hashlife)
+{
+	if (!hashlife) return;
+
+	struct hl *hl = hashlife->opaque;
+	if (!hl)
+		return;
+
+	struct node_block *cur = hl->blocks.head;
+	while(cur) {
+		struct node_block *del = cur;
+		cur = cur->next;
+		free(del);
+	}
+
+	free(hl->table.items);
+	free(hl);
+	hashlife->opaque = NULL;
+}
+
+/*
+ * Advances the root 2^log_stride generations.
+ */
+static int jump(struct hl *hl)
+{
+	struct node *root = hl->root;
+	while(root && (root->level < hl->log_stride + 3 || !is_padded(root)))
+		root = pad(hl, root);
+
+	struct node *next = successor(hl, root);
+	if (!next)
+		return 0;
+
+	hl->root = next;
+	return 1;
+}
+
+/*
+ * Appends the cells that differ between from and the root to changes.
+ */
+static int compare(struct hl *hl, struct node *from,
+                   struct state_change_buffer *changes)
+{
+	// Both are centred on the origin, compare them at the same size
+	struct node *a = from, *b = hl->root;
+	while(a && b && a->level < b->level)
+		a = pad(hl, a);
+	while(a && b && b->level < a->level)
+		b = pad(hl, b);
+	if (!a || !b)
+		return 0;
+
+	int64_t origin = -((int64_t)1 << (a->level - 1));
+	return diff(hl, a, b, origin, origin, changes);
+}
+
+/*
+ * Makes successor advance 2^log_stride generations from now on. The
+ * results memoised for the previous stride no longer hold.
+ */
+static void set_stride(struct hl *hl, unsigned log_stride)
+{
+	if (log_stride == hl->log_stride)
+		return;
+
+	for(unsigned i = 0; i < hl->table.length; ++i) {
+		for(struct node *n = hl->table.items[i]; n; n = n->next)
+			n->result = NULL;
+	}
+	hl->log_stride = log_stride;
+}
+
+int hashlife_step(struct hashlife *hashlife, struct state_change_buffer *changes)
+{
+	struct hl *hl = hashlife->opaque;
+
+	struct node *from = hl->root;
+	if (!jump(hl))
+		return 0;
+	if (!compare(hl, from, changes))
+		return 0;
+
+	collect(hl);
+	return 1;
+}
+
+int hashlife_advance(struct hashlife *hashlife, uint64_t generations,
+                     struct state_change_buffer *changes)
+{
+	struct hl *hl = hashlife->opaque;
+	unsigned log_stride = hl->log_stride;
+
+	// A jump of 2^k generations needs a root of level k+3
+	if (generations >> (MAX_LEVEL - 4))
+		return 0;
+
+	int ok = 1;
+	hl->from = hl->root;
+	for(unsigned k = MAX_LEVEL - 4; ok && k-- > 0;) {
+		if (!((generations >> k) & 1))
+			continue;
+
+		set_stride(hl, k);
+		ok = jump(hl);
+		collect(hl);
+	}
+	set_stride(hl, log_stride);
+
+	ok = ok && compare(hl, hl->from, changes);
+	hl->from = NULL;
+	collect(hl);
+	return ok;
+}
@@ -0,0 +1,35 @@
+
+struct hashlife {
+	void *opaque;
+};
+
+/*
+ * Creates a HashLife universe holding the cells in quad, following
+ * rule, which must not have B0.
+ * Every call to hashlife_step advances it by 2^log_stride generations.
+ *
+ * Unlike the bucket quadtree, the universe is unbounded. Coordinates
+ * above COORD_MAX/2 are taken to be negative, so patterns around the
+ * origin are kept together.
+ *
+ * Returns non-zero on success.
+ */
+int hashlife_create(struct hashlife *hl, struct quad *quad,
+                    unsigned log_stride, const struct rule *rule);
+void hashlife_destroy(struct hashlife *hl);
+
+/*
+ * Advances the universe and appends every cell that changed to
+ * changes.
+ * Returns non-zero on success.
+ */
+int hashlife_step(struct hashlife *hl, struct state_change_buffer *changes);
+/*
+ * Advances the universe by any number of generations at once, in the
+ * largest jumps that add up to it, and appends to changes only the
+ * cells that differ at the end. Results memoised for other strides
+ * than the one given at creation are forgotten on the way.
+ * Returns non-zero on success.
+ */
+int hashlife_advance(struct hashlife *hl, uint64_t generations,
+                     struct state_change_buffer *changes);
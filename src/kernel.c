@@ -0,0 +1,465 @@
+#include <stdio.h>  /* fprintf */
+
+#include "conway.h"
+#include "kernel.h"
+
+#include <stdlib.h> /* abort */
+#include <string.h> /* strcmp */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define KERNEL_X86
+#include <immintrin.h>
+#endif
+
+// {{{1 scalar
+
+static unsigned halo_cell(const struct halo *h, int x, unsigned y)
+{
+	if (x < 0)
+		return h->west[y] & 1;
+	if (x >= BUCKETSZ)
+		return (h->east[y] >> (BUCKETSZ-1)) & 1;
+	return (h->rows[y] >> x) & 1;
+}
+
+/*
+ * Counts the neighbours of every cell one at a time.
+ * Slow, but simple enough to serve as the reference for the others.
+ */
+static void rule_scalar(const struct rule *rule, const struct halo *h,
+                        bucket_row *next)
+{
+	for(unsigned y = 0; y < BUCKETSZ; ++y) {
+		bucket_row r = 0;
+
+		for(int x = 0; x < BUCKETSZ; ++x) {
+			unsigned n = 0;
+			for(unsigned dy = 0; dy < 3; ++dy) {
+				n += halo_cell(h, x-1, y+dy);
+				n += halo_cell(h, x,   y+dy);
+				n += halo_cell(h, x+1, y+dy);
+			}
+
+			unsigned alive = halo_cell(h, x, y+1);
+			n -= alive;
+
+			unsigned table = alive ? rule->survive : rule->born;
+			if ((table >> n) & 1)
+				r |= (bucket_row)1 << x;
+		}
+
+		next[y] = r;
+	}
+}
+
+static void kernel_scalar(const struct halo *h, bucket_row *next)
+{
+	rule_scalar(&RULE_CONWAY, h, next);
+}
+
+// 1}}}
+
+// {{{1 swar
+
+/*
+ * The eight neighbours of every cell in row y are summed in
+ * parallel, one bit per column, using a tree of full adders.
+ * The sum is left in s0 (ones), s1 (twos), and d0 and d1, which
+ * stand for four each.
+ */
+static inline void sum_row(const struct halo *h, unsigned y,
+                           bucket_row *s0, bucket_row *s1,
+                           bucket_row *d0, bucket_row *d1)
+{
+	bucket_row a = h->rows[y], b = h->rows[y+1], c = h->rows[y+2];
+
+	bucket_row n0 = (a << 1) | h->west[y];
+	bucket_row n1 = a;
+	bucket_row n2 = (a >> 1) | h->east[y];
+	bucket_row n3 = (b << 1) | h->west[y+1];
+	bucket_row n4 = (b >> 1) | h->east[y+1];
+	bucket_row n5 = (c << 1) | h->west[y+2];
+	bucket_row n6 = c;
+	bucket_row n7 = (c >> 1) | h->east[y+2];
+
+	// Full adders, three neighbours each
+	bucket_row x0 = n0 ^ n1 ^ n2;
+	bucket_row c0 = (n0 & n1) | (n2 & (n0 ^ n1));
+	bucket_row x1 = n3 ^ n4 ^ n5;
+	bucket_row c1 = (n3 & n4) | (n5 & (n3 ^ n4));
+	bucket_row x2 = n6 ^ n7;
+	bucket_row c2 = n6 & n7;
+
+	// Ones
+	*s0 = x0 ^ x1 ^ x2;
+	bucket_row c3 = (x0 & x1) | (x2 & (x0 ^ x1));
+
+	// Twos, and anything carried into the fours
+	bucket_row t0 = c0 ^ c1 ^ c2;
+	*d0 = (c0 & c1) | (c2 & (c0 ^ c1));
+	*s1 = t0 ^ c3;
+	*d1 = t0 & c3;
+}
+
+static void kernel_swar(const struct halo *h, bucket_row *next)
+{
+	for(unsigned y = 0; y < BUCKETSZ; ++y) {
+		bucket_row s0, s1, d0, d1;
+		sum_row(h, y, &s0, &s1, &d0, &d1);
+
+		// Survival on 2 or 3, birth on 3
+		next[y] = s1 & ~(d0 | d1) & (s0 | h->rows[y+1]);
+	}
+}
+
+/*
+ * Any other rule: the cells with each neighbour count in the rule
+ * are picked out of the sum, and kept where they are born or survive.
+ */
+static void rule_swar(const struct rule *rule, const struct halo *h,
+                      bucket_row *next)
+{
+	for(unsigned y = 0; y < BUCKETSZ; ++y) {
+		bucket_row s0, s1, d0, d1;
+		sum_row(h, y, &s0, &s1, &d0, &d1);
+
+		bucket_row b = h->rows[y+1];
+		bucket_row bits[4] = { s0, s1, d0 ^ d1, d0 & d1 };
+
+		bucket_row r = 0;
+		for(unsigned n = 0; n <= 8; ++n) {
+			unsigned born = (rule->born >> n) & 1;
+			unsigned survive = (rule->survive >> n) & 1;
+			if (!born && !survive)
+				continue;
+
+			bucket_row m = ~(bucket_row)0;
+			for(unsigned i = 0; i < 4; ++i)
+				m &= (n >> i) & 1 ? bits[i] : ~bits[i];
+
+			if (!born)
+				m &= b;
+			else if (!survive)
+				m &= ~b;
+			r |= m;
+		}
+
+		next[y] = r;
+	}
+}
+
+// 1}}}
+
+#ifdef KERNEL_X86
+
+/*
+ * The vector kernels run the same adder tree as kernel_swar, with one
+ * bucket_row in each lane. Rows above and below are read by loading
+ * the halo at an offset of one row.
+ */
+
+#if BUCKETSZ == 16
+#define SLLI128 _mm_slli_epi16
+#define SRLI128 _mm_srli_epi16
+#define SLLI256 _mm256_slli_epi16
+#define SRLI256 _mm256_srli_epi16
+#elif BUCKETSZ == 32
+#define SLLI128 _mm_slli_epi32
+#define SRLI128 _mm_srli_epi32
+#define SLLI256 _mm256_slli_epi32
+#define SRLI256 _mm256_srli_epi32
+#else
+#define SLLI128 _mm_slli_epi64
+#define SRLI128 _mm_srli_epi64
+#define SLLI256 _mm256_slli_epi64
+#define SRLI256 _mm256_srli_epi64
+#endif
+
+/*
+ * Number of rows in a 128 and 256-bit register.
+ */
+#define LANES128 (16 / sizeof(bucket_row))
+#define LANES256 (32 / sizeof(bucket_row))
+
+// {{{1 sse2
+
+__attribute__((target("sse2")))
+static void kernel_sse2(const struct halo *h, bucket_row *next)
+{
+#define LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+	for(unsigned y = 0; y < BUCKETSZ; y += LANES128) {
+		__m128i a = LOAD(h->rows + y);
+		__m128i b = LOAD(h->rows + y + 1);
+		__m128i c = LOAD(h->rows + y + 2);
+
+		__m128i n0 = _mm_or_si128(SLLI128(a, 1), LOAD(h->west + y));
+		__m128i n1 = a;
+		__m128i n2 = _mm_or_si128(SRLI128(a, 1), LOAD(h->east + y));
+		__m128i n3 = _mm_or_si128(SLLI128(b, 1), LOAD(h->west + y + 1));
+		__m128i n4 = _mm_or_si128(SRLI128(b, 1), LOAD(h->east + y + 1));
+		__m128i n5 = _mm_or_si128(SLLI128(c, 1), LOAD(h->west + y + 2));
+		__m128i n6 = c;
+		__m128i n7 = _mm_or_si128(SRLI128(c, 1), LOAD(h->east + y + 2));
+
+		__m128i x0 = _mm_xor_si128(_mm_xor_si128(n0, n1), n2);
+		__m128i c0 = _mm_or_si128(_mm_and_si128(n0, n1),
+		                          _mm_and_si128(n2, _mm_xor_si128(n0, n1)));
+		__m128i x1 = _mm_xor_si128(_mm_xor_si128(n3, n4), n5);
+		__m128i c1 = _mm_or_si128(_mm_and_si128(n3, n4),
+		                          _mm_and_si128(n5, _mm_xor_si128(n3, n4)));
+		__m128i x2 = _mm_xor_si128(n6, n7);
+		__m128i c2 = _mm_and_si128(n6, n7);
+
+		__m128i s0 = _mm_xor_si128(_mm_xor_si128(x0, x1), x2);
+		__m128i c3 = _mm_or_si128(_mm_and_si128(x0, x1),
+		                          _mm_and_si128(x2, _mm_xor_si128(x0, x1)));
+
+		__m128i t0 = _mm_xor_si128(_mm_xor_si128(c0, c1), c2);
+		__m128i d0 = _mm_or_si128(_mm_and_si128(c0, c1),
+		                          _mm_and_si128(c2, _mm_xor_si128(c0, c1)));
+		__m128i s1 = _mm_xor_si128(t0, c3);
+		__m128i d1 = _mm_and_si128(t0, c3);
+
+		__m128i r = _mm_andnot_si128(_mm_or_si128(d0, d1),
+		                             _mm_and_si128(s1, _mm_or_si128(s0, b)));
+		_mm_storeu_si128((__m128i*)(next + y), r);
+	}
+#undef LOAD
+}
+
+// 1}}}
+
+// {{{1 avx2
+
+__attribute__((target("avx2")))
+static void kernel_avx2(const struct halo *h, bucket_row *next)
+{
+#define LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+	for(unsigned y = 0; y < BUCKETSZ; y += LANES256) {
+		__m256i a = LOAD(h->rows + y);
+		__m256i b = LOAD(h->rows + y + 1);
+		__m256i c = LOAD(h->rows + y + 2);
+
+		__m256i n0 = _mm256_or_si256(SLLI256(a, 1), LOAD(h->west + y));
+		__m256i n1 = a;
+		__m256i n2 = _mm256_or_si256(SRLI256(a, 1), LOAD(h->east + y));
+		__m256i n3 = _mm256_or_si256(SLLI256(b, 1), LOAD(h->west + y + 1));
+		__m256i n4 = _mm256_or_si256(SRLI256(b, 1), LOAD(h->east + y + 1));
+		__m256i n5 = _mm256_or_si256(SLLI256(c, 1), LOAD(h->west + y + 2));
+		__m256i n6 = c;
+		__m256i n7 = _mm256_or_si256(SRLI256(c, 1), LOAD(h->east + y + 2));
+
+		__m256i x0 = _mm256_xor_si256(_mm256_xor_si256(n0, n1), n2);
+		__m256i c0 = _mm256_or_si256(_mm256_and_si256(n0, n1),
+		                             _mm256_and_si256(n2, _mm256_xor_si256(n0, n1)));
+		__m256i x1 = _mm256_xor_si256(_mm256_xor_si256(n3, n4), n5);
+		__m256i c1 = _mm256_or_si256(_mm256_and_si256(n3, n4),
+		                             _mm256_and_si256(n5, _mm256_xor_si256(n3, n4)));
+		__m256i x2 = _mm256_xor_si256(n6, n7);
+		__m256i c2 = _mm256_and_si256(n6, n7);
+
+		__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(x0, x1), x2);
+		__m256i c3 = _mm256_or_si256(_mm256_and_si256(x0, x1),
+		                             _mm256_and_si256(x2, _mm256_xor_si256(x0, x1)));
+
+		__m256i t0 = _mm256_xor_si256(_mm256_xor_si256(c0, c1), c2);
+		__m256i d0 = _mm256_or_si256(_mm256_and_si256(c0, c1),
+		                             _mm256_and_si256(c2, _mm256_xor_si256(c0, c1)));
+		__m256i s1 = _mm256_xor_si256(t0, c3);
+		__m256i d1 = _mm256_and_si256(t0, c3);
+
+		__m256i r = _mm256_andnot_si256(_mm256_or_si256(d0, d1),
+		                                _mm256_and_si256(s1, _mm256_or_si256(s0, b)));
+		_mm256_storeu_si256((__m256i*)(next + y), r);
+	}
+#undef LOAD
+}
+
+// 1}}}
+
+// {{{1 avx512
+
+/*
+ * Same register width as kernel_avx2, but every full adder is two
+ * ternary logic instructions instead of five.
+ */
+__attribute__((target("avx512f,avx512vl")))
+static void kernel_avx512(const struct halo *h, bucket_row *next)
+{
+#define LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define XOR3(a, b, c) _mm256_ternarylogic_epi32(a, b, c, 0x96)
+#define MAJ(a, b, c)  _mm256_ternarylogic_epi32(a, b, c, 0xe8)
+	for(unsigned y = 0; y < BUCKETSZ; y += LANES256) {
+		__m256i a = LOAD(h->rows + y);
+		__m256i b = LOAD(h->rows + y + 1);
+		__m256i c = LOAD(h->rows + y + 2);
+
+		__m256i n0 = _mm256_or_si256(SLLI256(a, 1), LOAD(h->west + y));
+		__m256i n1 = a;
+		__m256i n2 = _mm256_or_si256(SRLI256(a, 1), LOAD(h->east + y));
+		__m256i n3 = _mm256_or_si256(SLLI256(b, 1), LOAD(h->west + y + 1));
+		__m256i n4 = _mm256_or_si256(SRLI256(b, 1), LOAD(h->east + y + 1));
+		__m256i n5 = _mm256_or_si256(SLLI256(c, 1), LOAD(h->west + y + 2));
+		__m256i n6 = c;
+		__m256i n7 = _mm256_or_si256(SRLI256(c, 1), LOAD(h->east + y + 2));
+
+		__m256i x0 = XOR3(n0, n1, n2);
+		__m256i c0 = MAJ(n0, n1, n2);
+		__m256i x1 = XOR3(n3, n4, n5);
+		__m256i c1 = MAJ(n3, n4, n5);
+		__m256i x2 = _mm256_xor_si256(n6, n7);
+		__m256i c2 = _mm256_and_si256(n6, n7);
+
+		__m256i s0 = XOR3(x0, x1, x2);
+		__m256i c3 = MAJ(x0, x1, x2);
+
+		__m256i t0 = XOR3(c0, c1, c2);
+		__m256i d0 = MAJ(c0, c1, c2);
+		__m256i s1 = _mm256_xor_si256(t0, c3);
+		__m256i d1 = _mm256_and_si256(t0, c3);
+
+		// s1 & ~d0 & ~d1, then (s0 | b) & that
+		__m256i u = _mm256_ternarylogic_epi32(s1, d0, d1, 0x10);
+		__m256i r = _mm256_ternarylogic_epi32(s0, b, u, 0xa8);
+		_mm256_storeu_si256((__m256i*)(next + y), r);
+	}
+#undef MAJ
+#undef XOR3
+#undef LOAD
+}
+
+// 1}}}
+
+static int has_sse2()
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int has_avx2()
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int has_avx512()
+{
+	return __builtin_cpu_supports("avx512f")
+	    && __builtin_cpu_supports("avx512vl");
+}
+
+#endif /* KERNEL_X86 */
+
+// {{{1 dispatch
+
+struct kernel {
+	const char *name;
+	void (*step)(const struct halo*, bucket_row*);
+	int (*supported)();
+};
+
+/*
+ * Ordered from slowest to fastest.
+ */
+static const struct kernel kernels[] = {
+	{ "scalar", kernel_scalar, NULL },
+	{ "swar",   kernel_swar,   NULL },
+#ifdef KERNEL_X86
+	{ "sse2",   kernel_sse2,   has_sse2 },
+	{ "avx2",   kernel_avx2,   has_avx2 },
+	{ "avx512", kernel_avx512, has_avx512 },
+#endif
+};
+
+static const struct kernel *selected = &kernels[1];
+static int verify = 0;
+
+int kernel_select(const char *name)
+{
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+#endif
+
+	unsigned count = sizeof(kernels)/sizeof(kernels[0]);
+
+	for(unsigned i = count; i-- > 0;) {
+		const struct kernel *k = kernels + i;
+
+		if (name && strcmp(name, k->name) != 0)
+			continue;
+
+		if (k->supported && !k->supported())
+			continue;
+
+		selected = k;
+		return 1;
+	}
+	return 0;
+}
+
+const char* kernel_name()
+{
+	return selected->name;
+}
+
+void kernel_verify(int enable)
+{
+	verify = enable;
+}
+
+/*
+ * Ends the report of a cross-check that found row y to be got, not
+ * expect, and aborts.
+ */
+static void mismatch(unsigned y, bucket_row got, bucket_row expect)
+{
+	fprintf(stderr, " on row %u: 0x%0*llx, expected 0x%0*llx.\n", y,
+	        BUCKETSZ / 4, (unsigned long long)got,
+	        BUCKETSZ / 4, (unsigned long long)expect);
+	abort();
+}
+
+void kernel_step(const struct rule *rule, const struct halo *h,
+                 bucket_row next[BUCKETSZ])
+{
+	const struct rule conway = RULE_CONWAY;
+
+	if (rule->born == conway.born && rule->survive == conway.survive)
+		selected->step(h, next);
+	else
+		rule_swar(rule, h, next);
+
+	if (!verify)
+		return;
+
+	bucket_row expect[BUCKETSZ];
+	rule_scalar(rule, h, expect);
+
+	for(unsigned y = 0; y < BUCKETSZ; ++y) {
+		if (next[y] == expect[y])
+			continue;
+
+		fprintf(stderr, "Kernel %s disagrees with scalar",
+		        selected->name);
+		mismatch(y, next[y], expect[y]);
+	}
+}
+
+void kernel_check(const char *source, const struct rule *rule,
+                  const struct halo *h, const bucket_row next[BUCKETSZ])
+{
+	if (!verify)
+		return;
+
+	bucket_row expect[BUCKETSZ];
+	kernel_step(rule, h, expect);
+
+	for(unsigned y = 0; y < BUCKETSZ; ++y) {
+		if (next[y] == expect[y])
+			continue;
+
+		fprintf(stderr, "%s disagrees with kernel %s", source,
+		        selected->name);
+		mismatch(y, next[y], expect[y]);
+	}
+}
+
+// 1}}}
@@ -0,0 +1,63 @@
+
+/*
+ * One row of a bucket. Bit x holds the cell in column x.
+ */
+#if BUCKETSZ == 16
+typedef uint16_t bucket_row;
+#elif BUCKETSZ == 32
+typedef uint32_t bucket_row;
+#elif BUCKETSZ == 64
+typedef uint64_t bucket_row;
+#else
+#error "BUCKETSZ must be 16, 32 or 64"
+#endif
+
+/*
+ * A bucket together with the ring of cells surrounding it.
+ *
+ * rows[y+1] holds row y of the bucket, rows[0] and rows[BUCKETSZ+1]
+ * the adjacent rows of the northern and southern neighbours.
+ * west[y+1] and east[y+1] hold the cells just outside row y,
+ * already shifted into the first and last column respectively.
+ */
+struct halo {
+	bucket_row rows[BUCKETSZ + 2];
+	bucket_row west[BUCKETSZ + 2];
+	bucket_row east[BUCKETSZ + 2];
+};
+
+/*
+ * Selects the kernel used by kernel_step.
+ * name is one of "scalar", "swar", "sse2", "avx2" or "avx512".
+ * When name is NULL, the fastest kernel supported by the CPU is used.
+ *
+ * Returns non-zero on success, and zero if the kernel is unknown or
+ * not supported by the CPU.
+ */
+int kernel_select(const char *name);
+/*
+ * Returns the name of the selected kernel.
+ */
+const char* kernel_name();
+
+/*
+ * When enabled, every result of kernel_step is cross-checked against
+ * the scalar kernel, and those checked with kernel_check against
+ * kernel_step, aborting on the first mismatch.
+ */
+void kernel_verify(int enable);
+
+/*
+ * Computes the next generation of every row of the bucket in the halo
+ * under rule. Conway's rule runs on the selected kernel, any other on
+ * a SWAR kernel evaluating the rule table.
+ */
+void kernel_step(const struct rule *rule, const struct halo *h,
+                 bucket_row next[BUCKETSZ]);
+/*
+ * When verifying, cross-checks next, which source got for the bucket
+ * in the halo some other way than kernel_step, against kernel_step,
+ * aborting on a mismatch. Does nothing otherwise.
+ */
+void kernel_check(const char *source, const struct rule *rule,
+                  const struct halo *h, const bucket_row next[BUCKETSZ]);
@@ -3,7 +3,7 @@
 #include "conway.h"
 #include "load.h"
 
-#include <stdlib.h>  /* atoi */
+#include <stdlib.h>  /* atoi, malloc, realloc, free, qsort */
 
 int load_rle(struct quad *qua, struct bounds *bounds,
              FILE* stream, coordinate initial_x, coordinate initial_y)
@@ -111,12 +111,12 @@ int load_rle(struct quad *qua, struct bounds *bounds,
 				y += input_len;
 
 				if (bounds) {
-					if (!bounds->s_set || bounds->south < y) {
+					if (!bounds->s_set || bounds->south - bounds->north < y - bounds->north) {
 						bounds->south = y;
 						bounds->s_set = 1;
 					}
 
-					if (!bounds->e_set || bounds->east < x) {
+					if (!bounds->e_set || bounds->east - bounds->west < x - bounds->west) {
 						bounds->east = x;
 						bounds->e_set = 1;
 					}
@@ -125,7 +125,7 @@ int load_rle(struct quad *qua, struct bounds *bounds,
 				x = initial_x;
 				break;
 			case '!':
-				if (bounds && (!bounds->e_set || bounds->east < x)) {
+				if (bounds && (!bounds->e_set || bounds->east - bounds->west < x - bounds->west)) {
 					bounds->east = x;
 					bounds->e_set = 1;
 				}
@@ -144,7 +144,7 @@ int load_rle(struct quad *qua, struct bounds *bounds,
 		}
 	}
 
-	if (bounds && (!bounds->e_set || bounds->east < x)) {
+	if (bounds && (!bounds->e_set || bounds->east - bounds->west < x - bounds->west)) {
 		bounds->east = x;
 		bounds->e_set = 1;
 	}
@@ -184,12 +184,12 @@ int load_cells(struct quad *qua, struct bounds *bounds,
 		case '\n':
 			y++;
 			if (bounds) {
-				if (!bounds->s_set || bounds->south < y) {
+				if (!bounds->s_set || bounds->south - bounds->north < y - bounds->north) {
 					bounds->south = y;
 					bounds->s_set = 1;
 				}
 
-				if (!bounds->e_set || bounds->east < x) {
+				if (!bounds->e_set || bounds->east - bounds->west < x - bounds->west) {
 					bounds->east = x;
 					bounds->e_set = 1;
 				}
@@ -222,10 +222,154 @@ int load_cells(struct quad *qua, struct bounds *bounds,
 		col++;
 	}
 
-	if (bounds && (!bounds->e_set || bounds->east < x)) {
+	if (bounds && (!bounds->e_set || bounds->east - bounds->west < x - bounds->west)) {
 		bounds->east = x;
 		bounds->e_set = 1;
 	}
 	return 1;
 }
 
+
+
+struct cell {
+	int64_t x, y;
+};
+
+static int compare_cells(const void *a, const void *b)
+{
+	const struct cell *p = a, *q = b;
+	if (p->y != q->y)
+		return p->y < q->y ? -1 : 1;
+	if (p->x != q->x)
+		return p->x < q->x ? -1 : 1;
+	return 0;
+}
+
+struct cells {
+	size_t length, capacity;
+	struct cell *items;
+};
+
+static int collect(struct quad *quad, struct cells *cells)
+{
+	if (!quad->leaf) {
+		for(unsigned i = 0; i < 4; ++i) {
+			if (!collect(quad->children[i], cells))
+				return 0;
+		}
+		return 1;
+	}
+
+	for(struct bucket *b = quad->items.head; b; b = b->next) {
+		for(unsigned i = 0; i < BUCKETSZ * BUCKETSZ; ++i) {
+			if (!((b->bucket[i / VALUE_BIT] >> (i % VALUE_BIT)) & 1))
+				continue;
+
+			if (cells->length == cells->capacity) {
+				size_t new_cap = cells->capacity ? cells->capacity * 2 : 256;
+				void *tmp = realloc(cells->items, new_cap * sizeof(struct cell));
+				if (!tmp)
+					return 0;
+				cells->items = tmp;
+				cells->capacity = new_cap;
+			}
+
+			// Coordinates above COORD_MAX/2 are negative.
+			struct cell *c = cells->items + cells->length++;
+			c->x = (int64_t)(coordinate)(b->x * BUCKETSZ + i % BUCKETSZ);
+			c->y = (int64_t)(coordinate)(b->y * BUCKETSZ + i / BUCKETSZ);
+		}
+	}
+	return 1;
+}
+
+/*
+ * Writes count times tag, keeping lines at most 70 characters long.
+ */
+static void run(FILE *stream, unsigned *line, uint64_t count, char tag)
+{
+	if (count == 0)
+		return;
+
+	char buf[32];
+	int n = count == 1 ? snprintf(buf, sizeof(buf), "%c", tag)
+	                   : snprintf(buf, sizeof(buf), "%llu%c",
+	                              (unsigned long long)count, tag);
+	if (*line + n > 70) {
+		fputc('\n', stream);
+		*line = 0;
+	}
+	fputs(buf, stream);
+	*line += n;
+}
+
+static void print_rule(FILE *stream, const struct rule *rule)
+{
+	fputc('B', stream);
+	for(unsigned i = 0; i <= 8; ++i) {
+		if (rule->born & (1 << i))
+			fputc('0' + i, stream);
+	}
+	fputs("/S", stream);
+	for(unsigned i = 0; i <= 8; ++i) {
+		if (rule->survive & (1 << i))
+			fputc('0' + i, stream);
+	}
+}
+
+int save_rle(struct quad *qua, const struct rule *rule, FILE* stream)
+{
+	struct cells cells = { 0, 0, NULL };
+	if (!collect(qua, &cells)) {
+		free(cells.items);
+		return 0;
+	}
+	qsort(cells.items, cells.length, sizeof(struct cell), compare_cells);
+
+	int64_t west = 0, east = -1, north = 0, south = -1;
+	for(size_t i = 0; i < cells.length; ++i) {
+		struct cell c = cells.items[i];
+		if (i == 0 || c.x < west)
+			west = c.x;
+		if (i == 0 || c.x > east)
+			east = c.x;
+	}
+	if (cells.length) {
+		north = cells.items[0].y;
+		south = cells.items[cells.length - 1].y;
+	}
+
+	fprintf(stream, "#CXRLE Pos=%lld,%lld\n", (long long)west, (long long)north);
+	fprintf(stream, "x = %llu, y = %llu",
+	        (unsigned long long)(east - west + 1),
+	        (unsigned long long)(south - north + 1));
+	if (rule) {
+		fputs(", rule = ", stream);
+		print_rule(stream, rule);
+	}
+	fputc('\n', stream);
+
+	unsigned line = 0;
+	int64_t x = west, y = north;
+	for(size_t i = 0; i < cells.length;) {
+		struct cell c = cells.items[i];
+		if (c.y != y) {
+			run(stream, &line, c.y - y, '$');
+			y = c.y;
+			x = west;
+		}
+		run(stream, &line, c.x - x, 'b');
+
+		uint64_t live = 0;
+		for(; i < cells.length && cells.items[i].y == y
+		   && cells.items[i].x == c.x + (int64_t)live; ++i)
+			live++;
+		run(stream, &line, live, 'o');
+		x = c.x + live;
+	}
+	run(stream, &line, 1, '!');
+	fputc('\n', stream);
+
+	free(cells.items);
+	return !ferror(stream);
+}
@@ -9,3 +9,12 @@ int load_rle(struct quad *qua, struct bounds *bounds,
 
 int load_cells(struct quad *qua, struct bounds *bounds,
                FILE* stream, coordinate initial_x, coordinate initial_y);
+
+/*
+ * Writes every live cell in qua to stream as RLE, along with rule
+ * unless it is NULL. The position of the top left cell is kept in a
+ * #CXRLE comment.
+ *
+ * Returns non-zero on success.
+ */
+int save_rle(struct quad *qua, const struct rule *rule, FILE* stream);
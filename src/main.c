@@ -1,9 +1,14 @@
-#include <stdio.h> /* fprintf, fopen, fclose, perror */
+#include <stdio.h> /* fprintf, fopen, fclose, perror, stdout */
 
 #include "conway.h"
 #include "load.h"
+#include "domain.h"
+#include "checkpoint.h"
 
 #include "work_queue.h"
+#include "kernel.h"
+#include "topology.h"
+#include "memo.h"
 
 #ifndef DBG_SILENT
 #include "draw.h"
@@ -12,7 +17,10 @@
 #include <unistd.h> /* getopt, opatrg, optind */
 #include <time.h>   /* nanosleep */
 #include <string.h> /* strtok */
-#include <stdlib.h> /* atoi */
+#include <stdlib.h> /* atoi, strtoll, strtoull, free */
+#ifndef DBG_SILENT
+#include <pthread.h> /* pthread_create, pthread_join */
+#endif
 
 
 static void help()
@@ -28,18 +36,195 @@ static void help()
 	        "	-t	where to place the pattern's top left (x:y).\n"
 	        "	-w	number of worker threads.\n"
 	        "	-r	read RLE input.\n"
+	        "	-k	generation kernel (scalar, swar, sse2, avx2, avx512).\n"
+	        "	-x	cross-check the kernel against the scalar one.\n"
+	        "	-e	simulation engine (bucket, buffered, hashlife).\n"
+	        "	-j	advance 2^N generations per step (bucket, hashlife).\n"
+	        "	-S	print statistics when exiting.\n"
+	        "	-H	back the quadtree with huge pages.\n"
+	        "	-N	place buckets and workers on NUMA nodes.\n"
+	        "	-z	lay the quadtree out again every N generations.\n"
+	        "	-p	compute the next generation while drawing this one.\n"
+	        "	-m	remember the next generation of up to N buckets.\n"
+	        "	-T	wrap around a torus of N by N cells, a multiple of %d.\n"
+	        "	-R	rule in B/S notation (default B3/S23).\n"
+	        "	-P	split the universe across N processes (bucket).\n"
+	        "	-g	jump straight to generation N.\n"
+	        "	-o	write a checkpoint to FILE when exiting.\n"
+	        "	-l	start from the checkpoint in FILE, not a pattern.\n"
 	        "\n"
-	        "With no FILE, or when FILE is -, read standard input.\n");
+	        "With no FILE, or when FILE is -, read standard input.\n"
+	        "Without -T the universe is unbounded.\n"
+	        "Rules with B0 show the cells inverted on the generations\n"
+	        "where all of empty space is alive.\n"
+	        "With -P each process owns a strip of columns, and trades\n"
+	        "the cells along its edges with its neighbours every step.\n"
+	        "With -g nothing is drawn before generation N. Without a\n"
+	        "display its cells are written to standard output as RLE.\n",
+	        BUCKETSZ);
+}
+
+
+static void print_stats(struct conway *cw)
+{
+	struct conway_stats *s = &cw->stats;
+
+	fprintf(stderr, "Generations: %u\n", cw->generation);
+
+	struct quad *root = cw->root;
+	census(root);
+	if (root->population)
+		fprintf(stderr, "Population: %llu cells, "
+		                "from %lld,%lld to %lld,%lld\n",
+		        (unsigned long long)root->population,
+		        (long long)root->box.west, (long long)root->box.north,
+		        (long long)root->box.east, (long long)root->box.south);
+	else
+		fprintf(stderr, "Population: 0 cells\n");
+	fprintf(stderr, "Changes: %llu appended without locking, "
+	                "%llu under the lock\n",
+	        s->unlocked, s->locked);
+
+	unsigned long long buckets = s->stepped + s->skipped;
+	unsigned last = s->last_stepped + s->last_skipped;
+	if (buckets)
+		fprintf(stderr, "Buckets: %.1f%% active on average, "
+		                "%.1f%% in the last generation\n",
+		        100.0 * s->stepped / buckets,
+		        last ? 100.0 * s->last_stepped / last : 0.0);
+
+	struct memo *memo = cw->tree.memo;
+	if (memo && s->stepped)
+		fprintf(stderr, "Memo: %llu of %llu buckets stepped remembered "
+		                "(%.1f%%), %llu of %zu entries evicted\n",
+		        s->remembered, s->stepped,
+		        100.0 * s->remembered / s->stepped,
+		        memo->evictions, memo->capacity);
+
+	struct arena_stats *a = &cw->tree.arena.stats;
+	fprintf(stderr, "Arena: %llu allocations, %llu from free lists, "
+	                "%llu frees\n",
+	        a->allocations, a->reused, a->frees);
+	fprintf(stderr, "Arena: %llu of %llu calls to malloc and free avoided, "
+	                "%zu bytes resident in %llu slabs\n",
+	        a->allocations + a->frees - a->slabs,
+	        a->allocations + a->frees, a->resident, a->slabs);
 }
 
+/*
+ * Steps cw and trades the edges of the step with the other processes,
+ * saying so when either cannot be done.
+ *
+ * Returns non-zero on success.
+ */
+static int next_step(struct conway *cw, struct workq *queue,
+                     struct domain *domain)
+{
+	if (!conway_step(cw, queue)) {
+		fprintf(stderr, "Generation %u cannot be computed\n",
+		        cw->generation + cw->stride);
+		return 0;
+	}
+	if (!domain_exchange(domain, cw)) {
+		fprintf(stderr, "Generation %u cannot be exchanged\n",
+		        cw->generation + cw->stride);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Applies the changes of the last step of cw, saying so when they
+ * cannot be.
+ *
+ * Returns non-zero on success.
+ */
+static int next_update(struct conway *cw, struct workq *queue)
+{
+	if (!conway_update(cw, queue)) {
+		fprintf(stderr, "Generation %u cannot be applied\n",
+		        cw->generation);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Advances cw to generation target as conway_advance() does, but
+ * trading the edges with the other processes after every step. Steps
+ * keep the stride of the engine, which the halos are as wide as, until
+ * it would overshoot, and go one generation at a time from there.
+ *
+ * Returns non-zero on success.
+ */
+static int advance_domain(struct conway *cw, struct workq *queue,
+                          struct domain *domain, unsigned target)
+{
+	unsigned log_stride = 0;
+	while((1u << log_stride) < cw->stride)
+		log_stride++;
+
+	while(cw->generation < target) {
+		if (cw->generation + cw->stride > target
+		 && !conway_engine(cw, ENGINE_BUCKET, 0))
+			return 0;
+		if (!next_step(cw, queue, domain) || !next_update(cw, queue))
+			return 0;
+	}
+	return conway_engine(cw, ENGINE_BUCKET, log_stride);
+}
 
 #ifndef DBG_SILENT
-static void do_update(void *p, int run)
+/*
+ * The next generation, computed by a thread of its own while the main
+ * thread draws the last one from its changes.
+ */
+struct pipeline {
+	struct conway *cw;
+	struct workq *queue;
+	struct domain *domain;
+	int ok;
+};
+
+static void* compute(void *p)
+{
+	struct pipeline *next = p;
+
+	next->ok = next_step(next->cw, next->queue, next->domain);
+	if (next->ok) {
+		conway_changes(next->cw, next->queue);
+		next->ok = next_update(next->cw, next->queue);
+	}
+	return NULL;
+}
+
+/*
+ * Only applies the changes of the step already taken, while the main
+ * thread draws them.
+ */
+static void* apply_step(void *p)
 {
-	struct conway *cw = p;
+	struct pipeline *next = p;
 
-	if (run)
-		update(cw);
+	next->ok = next_update(next->cw, next->queue);
+	return NULL;
+}
+
+/*
+ * Swaps the changes held by a and b, each keeping its own segments.
+ */
+static void swap_changes(struct state_change_buffer *a,
+                         struct state_change_buffer *b)
+{
+	void *a_opaque = a->opaque;
+	void *b_opaque = b->opaque;
+
+	struct state_change_buffer tmp = *a;
+	*a = *b;
+	*b = tmp;
+
+	a->opaque = a_opaque;
+	b->opaque = b_opaque;
 }
 #endif /* DBG_SILENT */
 
@@ -55,15 +240,31 @@ int main(int argc, char *argv[])
 	display.dbg = 0;
 #endif /* DBG_SILENT */
 
-	int pattx = -1; int patty = -1;
+	coordinate pattx = 0; coordinate patty = 0;
+	int patt = 0;
 	int speed = 100;
 	int threads = 4;
 	char* tok;
 	int rle = 0;
+	char *kernel = NULL;
+	enum conway_engine engine = ENGINE_BUCKET;
+	int jump = -1;
+	int stats = 0;
+	int huge_pages = 0;
+	int numa = 0;
+	coordinate torus = 0;
+	struct rule rule = RULE_CONWAY;
+	unsigned processes = 1;
+	unsigned target = 0;
+	unsigned relayout = 0;
+	int pipelined = 0;
+	size_t memo = 0;
+	char *save = NULL;
+	char *restore = NULL;
 
 
 	int c;
-	while((c = getopt(argc, argv, "hcrfs:b:t:w:")) != -1) {
+	while((c = getopt(argc, argv, "hcrxSHNpfs:b:t:w:k:e:j:T:R:P:g:o:l:z:m:")) != -1) {
 		switch(c) {
 		case 'h':
 			help();
@@ -93,23 +294,97 @@ int main(int argc, char *argv[])
 		case 't':
 			tok = strtok(optarg, ":");
 			if (tok == NULL) break;
-			pattx = atoi(tok);
+			pattx = strtoll(tok, NULL, 10);
 			tok = strtok(NULL, ":");
 			if (tok == NULL) break;
-			patty = atoi(tok);
+			patty = strtoll(tok, NULL, 10);
+			patt = 1;
 			break;
 		case 'w':
 			threads = atoi(optarg);
 			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'x':
+			kernel_verify(1);
+			break;
+		case 'e':
+			if (strcmp(optarg, "bucket") == 0) {
+				engine = ENGINE_BUCKET;
+			} else if (strcmp(optarg, "buffered") == 0) {
+				engine = ENGINE_BUFFERED;
+			} else if (strcmp(optarg, "hashlife") == 0) {
+				engine = ENGINE_HASHLIFE;
+			} else {
+				fprintf(stderr, "Unknown engine %s.\n", optarg);
+				return 1;
+			}
+			break;
+		case 'j':
+			jump = atoi(optarg);
+			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'H':
+			huge_pages = 1;
+			break;
+		case 'N':
+			numa = 1;
+			break;
+		case 'p':
+			pipelined = 1;
+			break;
+		case 'T':
+			torus = strtoull(optarg, NULL, 10);
+			if (!torus || torus % BUCKETSZ || torus - 1 > COORD_MAX / 2) {
+				fprintf(stderr, "Torus size must be a non-zero multiple of %d, "
+				                "at most 2^63.\n", BUCKETSZ);
+				return 1;
+			}
+			break;
+		case 'R':
+			if (!rule_parse(&rule, optarg)) {
+				fprintf(stderr, "Rule %s is not in B/S notation.\n", optarg);
+				return 1;
+			}
+			break;
+		case 'P':
+			processes = atoi(optarg);
+			if (processes == 0) {
+				fprintf(stderr, "Option -P requires at least one process.\n");
+				return 1;
+			}
+			break;
+		case 'g':
+			target = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			save = optarg;
+			break;
+		case 'l':
+			restore = optarg;
+			break;
+		case 'z':
+			relayout = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			memo = strtoull(optarg, NULL, 10);
+			if (memo == 0) {
+				fprintf(stderr, "Option -m requires at least one entry.\n");
+				return 1;
+			}
+			break;
 		case 'b':
 #ifndef DBG_SILENT
 			tok = strtok(optarg, ":");
 			if (tok == NULL) break;
-			display.view.x = atoi(tok);
+			display.view.x = strtoll(tok, NULL, 10);
 
 			tok = strtok(NULL, ":");
 			if (tok == NULL) break;
-			display.view.y = atoi(tok);
+			display.view.y = strtoll(tok, NULL, 10);
 
 			tok = strtok(NULL, ":");
 			if (tok == NULL) break;
@@ -130,6 +405,17 @@ int main(int argc, char *argv[])
 			case 'y':
 			case 'w':
 			case 'h':
+			case 'k':
+			case 'e':
+			case 'j':
+			case 'T':
+			case 'R':
+			case 'P':
+			case 'g':
+			case 'o':
+			case 'l':
+			case 'z':
+			case 'm':
 				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 				return 1;
 			default:
@@ -140,40 +426,105 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (jump >= 0 && engine == ENGINE_BUFFERED) {
+		fprintf(stderr, "Option -j may not be used with -e buffered.\n");
+		return 1;
+	}
+	if (jump >= 0 && engine == ENGINE_BUCKET
+	 && (jump >= 31 || (1 << jump) > BUCKETSZ)) {
+		fprintf(stderr, "Option -j may advance at most %d generations "
+		                "with -e bucket.\n", BUCKETSZ);
+		return 1;
+	}
+	if (jump > 0 && engine == ENGINE_BUCKET && (rule.born & 1)) {
+		fprintf(stderr, "Rules with B0 may not be used with -j.\n");
+		return 1;
+	}
+	if (jump < 0)
+		jump = 0;
+
+	if (torus && engine == ENGINE_HASHLIFE) {
+		fprintf(stderr, "Option -T may not be used with -e hashlife.\n");
+		return 1;
+	}
+	if ((rule.born & 1) && engine == ENGINE_HASHLIFE) {
+		fprintf(stderr, "Rules with B0 may not be used with -e hashlife.\n");
+		return 1;
+	}
+	if (processes > 1 && engine != ENGINE_BUCKET) {
+		fprintf(stderr, "Option -P may only be used with -e bucket.\n");
+		return 1;
+	}
+	if (processes > 1 && save) {
+		fprintf(stderr, "Option -o may not be used with -P.\n");
+		return 1;
+	}
+	// The halo of a strip is as wide as a step is long.
+	if (processes > 1 && (jump >= 31 || (1 << jump) > BUCKETSZ)) {
+		fprintf(stderr, "Option -P may step at most %d generations "
+		                "at once.\n", BUCKETSZ);
+		return 1;
+	}
+
+	if (!kernel_select(kernel)) {
+		fprintf(stderr, "Kernel %s is unknown or not supported.\n", kernel);
+		return 1;
+	}
+
 	struct quad quad;
-	quad.west = 0;
-	quad.east = (COORD_MAX / BUCKETSZ)+1;
-	quad.north = 0;
-	quad.south = (COORD_MAX / BUCKETSZ)+1;
 	quad.leaf = 1;
 	quad.count = 0;
 	quad.parent = NULL;
+	quad.tree = NULL;
 	quad.items.head = NULL;
 	quad.items.tail = NULL;
 
+	struct conway conway;
+	if (!conway_create(&conway, &quad, huge_pages, torus)) {
+		fprintf(stderr, "Arena cannot be created\n");
+		return 1;
+	}
+	conway_rule(&conway, &rule);
+
+	if (memo && !conway_memo(&conway, memo)) {
+		fprintf(stderr, "Memo of %zu entries cannot be created\n", memo);
+		return 1;
+	}
+
+	struct topology topology;
+	if (numa) {
+		if (!topology_create(&topology)
+		 || !conway_numa(&conway, &topology)) {
+			fprintf(stderr, "Buckets cannot be placed on NUMA nodes\n");
+			return 1;
+		}
+	}
+
 
 	struct bounds patt_bounds = {
 		0, 0, 0, 0,
 		0, 0, 0, 0,
 	};
 #ifndef DBG_SILENT
-	if (pattx == -1)
+	if (!patt) {
 		pattx = display.view.x + display.view.w/2;
-	if (patty == -1)
 		patty = display.view.y + display.view.h/2;
+	}
 #else
-	if (pattx == -1)
-		pattx = 0;
-	if (patty == -1)
-		patty = 0;
+	(void)(patt);
 #endif
 
-	FILE* stream;
+	FILE* stream = NULL;
 	switch(argc - optind) {
 		case 0:
-			stream = stdin;
+			if (!restore)
+				stream = stdin;
 			break;
 		case 1:
+			if (restore) {
+				fprintf(stderr, "Option -l may not be used with FILE.\n");
+				return 1;
+			}
 			stream = fopen(argv[optind], "r");
 			if (stream == NULL) {
 				perror(argv[optind]);
@@ -188,7 +539,12 @@ int main(int argc, char *argv[])
 			return 1;
 	}
 
-	if (rle) {
+	if (restore) {
+		if (!checkpoint_restore(&conway, &patt_bounds, restore)) {
+			fprintf(stderr, "Checkpoint %s cannot be restored\n", restore);
+			return 1;
+		}
+	} else if (rle) {
 		if (!load_rle(&quad, &patt_bounds, stream, pattx, patty))
 			return 1;
 	} else {
@@ -196,18 +552,31 @@ int main(int argc, char *argv[])
 			return 1;
 	}
 
-	if (stream != stdin)
+	if (stream && stream != stdin)
 		fclose(stream);
 
+	// Before any thread or window, which the processes cannot share.
+	struct domain domain;
+	// A single process owns the whole universe, and has no halo.
+	memset(&domain, 0, sizeof(domain));
+	domain.size = 1;
+	if (processes > 1
+	 && !domain_split(&domain, processes, &conway, &patt_bounds,
+	                  1u << jump)) {
+		fprintf(stderr, "Universe cannot be split across %u processes\n",
+		        processes);
+		return 1;
+	}
+	census(&quad);
+
 #ifndef DBG_SILENT
 	if (display.view.w == 0 || display.view.h == 0) {
-		if (patt_bounds.w_set && patt_bounds.e_set
-		 && patt_bounds.n_set && patt_bounds.s_set) {
-			display.view.x = patt_bounds.west - 4;
-			display.view.y = patt_bounds.north - 4;
+		if (quad.population) {
+			display.view.x = quad.box.west - 4;
+			display.view.y = quad.box.north - 4;
 
-			display.view.w = patt_bounds.east - display.view.x + 4;
-			display.view.h = patt_bounds.south - display.view.y + 4;
+			display.view.w = quad.box.east - display.view.x + 4;
+			display.view.h = quad.box.south - display.view.y + 4;
 		} else {
 			display.view.w = 200 / display.view.scale;
 			display.view.h = 150 / display.view.scale;
@@ -221,59 +590,176 @@ int main(int argc, char *argv[])
 #endif /* DBG_SILENT */
 
 
-	struct conway conway;
-	if (!conway_create(&conway, &quad)) {
-		fprintf(stderr, "Arena cannot be created\n");
+	if (!conway_engine(&conway, engine, jump)) {
+		fprintf(stderr, "Engine cannot be created\n");
 		return 1;
 	}
 
-#ifndef DBG_SILENT
-	enum draw_update_result du = draw_update(&display);
-	if (du != DR_OK)
-		return 0;
-
-	draw(&display, &quad, &conway.changes);
-#endif /* DBG_SILENT */
-
-
 	struct workq queue;
 	if (!workq_create(&queue)) {
 		fprintf(stderr, "Queue cannot be created\n");
 		return 1;
 	}
+	if (numa && !workq_pin(&queue, &topology)) {
+		fprintf(stderr, "Workers cannot be pinned\n");
+		return 1;
+	}
 	if (!workq_start(&queue, threads)) {
 		fprintf(stderr, "Queue cannot be started\n");
 		return 1;
 	}
 
-	struct timespec time = { 0, speed * 1000000 };
-	do {
-		conway.changes.length = 0;
-		step(&quad, &conway.changes, &queue);
-		workq_wait(&queue);
+	int running = 1;
+	if (target) {
+		int ok = target <= conway.generation
+		      || (domain.size > 1
+		          ? advance_domain(&conway, &queue, &domain, target)
+		          : conway_advance(&conway, target - conway.generation,
+		                           &queue));
+		if (!ok) {
+			fprintf(stderr, "Generation %u cannot be computed\n", target);
+			return 1;
+		}
+#ifdef DBG_SILENT
+		// Inverted cells stand for a universe that is alive all the
+		// way out, which RLE cannot hold.
+		if (conway.phase) {
+			fprintf(stderr, "Generation %u of a rule with B0 cannot be "
+			                "written, its empty space is alive.\n",
+			        target);
+			return 1;
+		}
+		// The first process writes the cells of every strip.
+		if (!domain_gather(&domain, &conway)) {
+			fprintf(stderr, "Generation %u cannot be gathered\n", target);
+			return 1;
+		}
+		if (domain.rank == 0 && !save_rle(&quad, &conway.rule, stdout))
+			perror("stdout");
+		running = 0;
+#endif /* DBG_SILENT */
+	}
 
+#ifndef DBG_SILENT
+	enum draw_update_result du = draw_update(&display);
+	if (du != DR_OK)
+		return 0;
+
+	draw(&display, &quad, &conway.changes);
+#endif /* DBG_SILENT */
+
+
+	unsigned laid_out = conway.generation;
+	struct timespec time = { 0, speed * 1000000 };
+#ifndef DBG_SILENT
+	/*
+	 * With -p, the changes of the generation on screen, drawn while
+	 * the next one goes into conway.changes.
+	 */
+	struct state_change_buffer drawn;
+	memset(&drawn, 0, sizeof(drawn));
+#else
+	(void)(pipelined);
+#endif /* DBG_SILENT */
+	while(running) {
 #ifdef DBG_SILENT
-		update(&conway);
+		if (!next_step(&conway, &queue, &domain)
+		 || !next_update(&conway, &queue))
+			break;
+
 		if (conway.generation >= 1000)
 			break;
 #else
-		workq_add(&queue, &conway, do_update);
+		if (pipelined) {
+			enum draw_update_result du = draw_update(&display);
+			if (du != DR_OK)
+				break;
+
+			// Painting the whole view reads the quadtree, which the
+			// next generation changes, so that has to come first.
+			int whole = draw_needs_tree(&display);
+			if (whole)
+				draw(&display, &quad, &drawn);
+
+			struct pipeline next = { &conway, &queue, &domain, 0 };
+			pthread_t thread;
+			int threaded = pthread_create(&thread, NULL, compute,
+			                              &next) == 0;
+			if (!threaded)
+				compute(&next);
+
+			if (!whole)
+				draw(&display, &quad, &drawn);
+
+			if (threaded)
+				pthread_join(thread, NULL);
+			if (!next.ok)
+				break;
+
+			swap_changes(&drawn, &conway.changes);
+		} else {
+			if (!next_step(&conway, &queue, &domain))
+				break;
+
+			conway_changes(&conway, &queue);
+
+			enum draw_update_result du = draw_update(&display);
+			if (du != DR_OK)
+				break;
+
+			// Drawing only the changes leaves the quadtree to the
+			// update, which a thread of its own makes meanwhile.
+			struct pipeline next = { &conway, &queue, &domain, 0 };
+			pthread_t thread;
+			int threaded = !draw_needs_tree(&display)
+			            && pthread_create(&thread, NULL, apply_step,
+			                              &next) == 0;
+
+			draw(&display, &quad, &conway.changes);
+
+			if (threaded)
+				pthread_join(thread, NULL);
+			else
+				apply_step(&next);
+			if (!next.ok)
+				break;
+		}
+#endif /* DBG_SILENT */
 
-		enum draw_update_result du = draw_update(&display);
-		if (du != DR_OK)
-			break;
+		if (relayout && conway.generation - laid_out >= relayout) {
+			// Not fatal, the buckets just stay where they are.
+			if (!conway_relayout(&conway))
+				fprintf(stderr, "Generation %u cannot be laid out again\n",
+				        conway.generation);
+			laid_out = conway.generation;
+		}
 
-		draw(&display, &quad, &conway.changes);
+		running = speed == 0 ? 1 : !nanosleep(&time, NULL);
+	}
 
-		workq_wait(&queue);
+	workq_destroy(&queue);
+#ifndef DBG_SILENT
+	// Whichever arrays were swapped in last, conway keeps the others.
+	free(drawn.items);
+	free(drawn.buckets);
+	memset(&drawn, 0, sizeof(drawn));
 #endif /* DBG_SILENT */
 
-	} while(speed == 0 ? 1 : !nanosleep(&time, NULL));
+	if (save && !checkpoint_save(&conway, save))
+		fprintf(stderr, "Checkpoint %s cannot be written\n", save);
 
-	workq_destroy(&queue);
+	if (stats) {
+		if (domain.size > 1)
+			fprintf(stderr, "Process %u of %u:\n",
+			        domain.rank + 1, domain.size);
+		print_stats(&conway);
+	}
 
 	release(&quad);
 	conway_destroy(&conway);
+	domain_destroy(&domain);
+	if (numa)
+		topology_destroy(&topology);
 
 #ifndef DBG_SILENT
 	draw_destroy(&display);
@@ -0,0 +1,191 @@
+#include "conway.h"
+#include "kernel.h"
+#include "memo.h"
+
+#include <stdlib.h> /* calloc, free */
+#include <string.h> /* memcmp, memcpy */
+
+/*
+ * A result may go in any of the WAYS entries of the set its key hashes
+ * to, and evicts the first of them not used since the hand last came
+ * by when all are taken.
+ */
+#define WAYS 4
+
+/*
+ * The rows of the bucket and the rows above and below it, then the
+ * cells to the west and to the east of the rows of the bucket, a bit
+ * a row, then the four corners.
+ */
+#define KEY_ROWS (BUCKETSZ + 5)
+
+struct entry {
+	uint64_t hash;
+	uint32_t rule;
+	unsigned char used, referenced;
+	bucket_row key[KEY_ROWS];
+	bucket_row next[BUCKETSZ];
+};
+
+struct set {
+	/*
+	 * Non-zero while a thread looks at the set. Whoever finds it
+	 * taken does without the memo rather than wait.
+	 */
+	unsigned char lock;
+	unsigned char hand;
+	struct entry ways[WAYS];
+};
+
+struct sets {
+	size_t length;
+	struct set items[];
+};
+
+int memo_create(struct memo *memo, size_t entries)
+{
+	if (!memo) return 0;
+
+	size_t length = 1;
+	while(length * 2 * WAYS <= entries)
+		length *= 2;
+
+	struct sets *s = calloc(1, sizeof(struct sets)
+	                           + length * sizeof(struct set));
+	if (!s)
+		return 0;
+
+	s->length = length;
+	memo->capacity = length * WAYS;
+	memo->evictions = 0;
+	memo->opaque = s;
+	return 1;
+}
+
+void memo_destroy(struct memo *memo)
+{
+	if (!memo) return;
+
+	free(memo->opaque);
+	memo->opaque = NULL;
+	memo->capacity = 0;
+}
+
+static void make_key(const struct halo *h, bucket_row key[KEY_ROWS])
+{
+	const coordinate max = BUCKETSZ-1;
+
+	bucket_row west = 0, east = 0;
+	for(coordinate y = 0; y < BUCKETSZ + 2; ++y)
+		key[y] = h->rows[y];
+	for(coordinate y = 0; y < BUCKETSZ; ++y) {
+		west |= (h->west[y+1] & 1) << y;
+		east |= (h->east[y+1] >> max) << y;
+	}
+	key[BUCKETSZ+2] = west;
+	key[BUCKETSZ+3] = east;
+	key[BUCKETSZ+4] = (h->west[0] & 1)
+	                | (h->east[0] >> max) << 1
+	                | (h->west[BUCKETSZ+1] & 1) << 2
+	                | (h->east[BUCKETSZ+1] >> max) << 3;
+}
+
+static uint64_t hash(const bucket_row key[KEY_ROWS], uint32_t rule)
+{
+	uint64_t h = rule;
+	for(unsigned i = 0; i < KEY_ROWS; ++i)
+		h = h * 0x9e3779b97f4a7c15ull + key[i];
+	return h ^ (h >> 32);
+}
+
+static int lock_set(struct set *set)
+{
+	return !__atomic_exchange_n(&set->lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static void unlock_set(struct set *set)
+{
+	__atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the result for key out of set into next.
+ * Returns non-zero when set holds it.
+ */
+static int find(struct set *set, const bucket_row key[KEY_ROWS],
+                uint64_t hash, uint32_t rule, bucket_row next[BUCKETSZ])
+{
+	for(unsigned i = 0; i < WAYS; ++i) {
+		struct entry *e = set->ways + i;
+		if (!e->used || e->hash != hash || e->rule != rule
+		 || memcmp(e->key, key, sizeof(e->key)) != 0)
+			continue;
+
+		memcpy(next, e->next, sizeof(e->next));
+		e->referenced = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Keeps the result for key in set, over the entry under the hand
+ * unless it was referenced since the hand last passed it.
+ * Returns non-zero when another result was dropped.
+ */
+static int keep(struct set *set, const bucket_row key[KEY_ROWS],
+                uint64_t hash, uint32_t rule,
+                const bucket_row next[BUCKETSZ])
+{
+	struct entry *e = set->ways + set->hand;
+	while(e->used && e->referenced) {
+		e->referenced = 0;
+		set->hand = (set->hand + 1) % WAYS;
+		e = set->ways + set->hand;
+	}
+	set->hand = (set->hand + 1) % WAYS;
+
+	int evicted = e->used;
+	memcpy(e->key, key, sizeof(e->key));
+	memcpy(e->next, next, sizeof(e->next));
+	e->hash = hash;
+	e->rule = rule;
+	e->used = 1;
+	e->referenced = 0;
+	return evicted;
+}
+
+int memo_step(struct memo *memo, const struct rule *rule,
+              const struct halo *h, bucket_row next[BUCKETSZ])
+{
+	if (!memo) {
+		kernel_step(rule, h, next);
+		return 0;
+	}
+
+	struct sets *s = memo->opaque;
+	bucket_row key[KEY_ROWS];
+	make_key(h, key);
+	uint32_t r = rule->born | (uint32_t)rule->survive << 16;
+	uint64_t k = hash(key, r);
+	struct set *set = s->items + (k & (s->length - 1));
+
+	if (lock_set(set)) {
+		int found = find(set, key, k, r, next);
+		unlock_set(set);
+		if (found) {
+			kernel_check("Memo", rule, h, next);
+			return 1;
+		}
+	}
+
+	kernel_step(rule, h, next);
+
+	if (lock_set(set)) {
+		int evicted = keep(set, key, k, r, next);
+		unlock_set(set);
+		if (evicted)
+			__atomic_fetch_add(&memo->evictions, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
@@ -0,0 +1,38 @@
+
+/*
+ * A cache of the next generation of buckets, keyed by the cells of a
+ * bucket and the ring around it, for buckets whose surroundings recur,
+ * such as oscillators in ash. Needs conway.h and kernel.h first.
+ */
+struct memo {
+	/*
+	 * Number of entries, a power of two.
+	 */
+	size_t capacity;
+	/*
+	 * Entries dropped to make room for another one.
+	 */
+	unsigned long long evictions;
+	void *opaque;
+};
+
+/*
+ * Creates a memo of at most entries entries, and at least a few.
+ *
+ * Returns non-zero on success.
+ */
+int memo_create(struct memo *memo, size_t entries);
+void memo_destroy(struct memo *memo);
+
+/*
+ * Computes the next generation of the bucket in h under rule into
+ * next, as kernel_step does, unless memo holds it already. Results
+ * computed are kept, making room with a clock over the few entries
+ * a result may go in. With kernel_verify, results found are checked
+ * against kernel_step. memo may be NULL, and may be used from any
+ * number of threads at once.
+ *
+ * Returns non-zero when next was found in memo.
+ */
+int memo_step(struct memo *memo, const struct rule *rule,
+              const struct halo *h, bucket_row next[BUCKETSZ]);
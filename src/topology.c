@@ -0,0 +1,160 @@
+#define _GNU_SOURCE    /* cpu_set_t, pthread_setaffinity_np */
+
+#include "topology.h"
+
+#include <stdio.h>     /* FILE, fopen, fscanf, snprintf */
+#include <stdlib.h>    /* malloc, free */
+#include <string.h>    /* memset */
+#include <unistd.h>    /* syscall */
+#include <sched.h>     /* cpu_set_t, CPU_SET */
+#include <pthread.h>   /* pthread_setaffinity_np */
+#include <sys/syscall.h>
+
+#define NODES_MAX 256
+
+/*
+ * mbind policy placing pages on the node given, or elsewhere once
+ * it is full. As in <numaif.h>, which needs libnuma.
+ */
+#define MPOL_PREFERRED 1
+
+struct node {
+	/*
+	 * Number the system knows the node by.
+	 */
+	unsigned id;
+	cpu_set_t cpus;
+};
+
+struct topo {
+	struct node nodes[NODES_MAX];
+};
+
+/*
+ * Reads a list such as 0-3,8,10-11 from path, calling add for every
+ * number in it. Returns zero when path cannot be read.
+ */
+static int read_list(const char *path, void (*add)(unsigned, void*),
+                     void *data)
+{
+	FILE *stream = fopen(path, "r");
+	if (!stream)
+		return 0;
+
+	unsigned first, last;
+	while(fscanf(stream, "%u", &first) == 1) {
+		last = first;
+		int c = fgetc(stream);
+		if (c == '-') {
+			if (fscanf(stream, "%u", &last) != 1)
+				break;
+			c = fgetc(stream);
+		}
+		for(unsigned i = first; i <= last && i < CPU_SETSIZE; ++i)
+			add(i, data);
+		if (c != ',')
+			break;
+	}
+
+	fclose(stream);
+	return 1;
+}
+
+static void add_cpu(unsigned cpu, void *data)
+{
+	CPU_SET(cpu, (cpu_set_t*)data);
+}
+
+static void add_node(unsigned id, void *data)
+{
+	struct topology *topology = data;
+	struct topo *t = topology->opaque;
+	if (topology->nodes == NODES_MAX || id >= NODES_MAX)
+		return;
+
+	struct node *n = t->nodes + topology->nodes;
+	n->id = id;
+	CPU_ZERO(&n->cpus);
+
+	char path[64];
+	snprintf(path, sizeof(path),
+	         "/sys/devices/system/node/node%u/cpulist", id);
+	read_list(path, add_cpu, &n->cpus);
+
+	// Nodes of memory alone have no workers to place anything for.
+	if (CPU_COUNT(&n->cpus))
+		topology->nodes++;
+}
+
+int topology_create(struct topology *topology)
+{
+	if (!topology) return 0;
+
+	struct topo *t = malloc(sizeof(struct topo));
+	if (!t)
+		return 0;
+
+	memset(t, 0, sizeof(struct topo));
+	topology->opaque = t;
+	topology->nodes = 0;
+
+	read_list("/sys/devices/system/node/online", add_node, topology);
+	if (!topology->nodes) {
+		// No NUMA: a single node, with whichever CPUs we may use.
+		t->nodes[0].id = 0;
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &t->nodes[0].cpus) < 0)
+			CPU_ZERO(&t->nodes[0].cpus);
+		topology->nodes = 1;
+	}
+	return 1;
+}
+
+void topology_destroy(struct topology *topology)
+{
+	if (!topology || !topology->opaque) return;
+
+	free(topology->opaque);
+	topology->opaque = NULL;
+	topology->nodes = 0;
+}
+
+int topology_pin(const struct topology *topology, unsigned node)
+{
+	if (node >= topology->nodes) return 0;
+
+	struct topo *t = topology->opaque;
+	const cpu_set_t *cpus = &t->nodes[node].cpus;
+	if (!CPU_COUNT(cpus))
+		return 0;
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+	                              cpus) == 0;
+}
+
+int topology_place(const struct topology *topology, void *p, size_t size,
+                   unsigned node)
+{
+	if (node >= topology->nodes) return 0;
+
+	// A single node places everything already.
+	if (topology->nodes == 1)
+		return 1;
+
+#ifdef SYS_mbind
+	struct topo *t = topology->opaque;
+	unsigned id = t->nodes[node].id;
+
+	unsigned long mask[NODES_MAX / (8 * sizeof(unsigned long))];
+	memset(mask, 0, sizeof(mask));
+	mask[id / (8 * sizeof(unsigned long))] |=
+		1ul << (id % (8 * sizeof(unsigned long)));
+
+	// The kernel reads one bit fewer than it is told.
+	return syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask,
+	               (unsigned long)NODES_MAX + 1, 0) == 0;
+#else
+	(void)(p);
+	(void)(size);
+	return 0;
+#endif
+}
@@ -0,0 +1,38 @@
+#include <stddef.h> /* size_t */
+
+/*
+ * The NUMA nodes of the machine, and the CPUs on each of them.
+ */
+struct topology {
+	/*
+	 * Number of nodes with CPUs, numbered from zero whatever the
+	 * system calls them. A machine without NUMA, or one that does
+	 * not say, has a single node with every CPU.
+	 */
+	unsigned nodes;
+	void *opaque;
+};
+
+/*
+ * Reads the nodes of the machine from /sys/devices/system/node.
+ *
+ * Returns non-zero on success.
+ */
+int topology_create(struct topology *topology);
+void topology_destroy(struct topology *topology);
+
+/*
+ * Keeps the calling thread on the CPUs of node.
+ *
+ * Returns non-zero on success.
+ */
+int topology_pin(const struct topology *topology, unsigned node);
+/*
+ * Asks for the pages from p to p + size, which must start on a page,
+ * to be placed in the memory of node when they are first touched.
+ * They go elsewhere when the node runs out.
+ *
+ * Returns non-zero on success.
+ */
+int topology_place(const struct topology *topology, void *p, size_t size,
+                   unsigned node);
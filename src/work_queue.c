@@ -1,4 +1,5 @@
 #include "work_queue.h"
+#include "topology.h"
 
 #include <stdlib.h>  /* malloc, free */
 #include <pthread.h>
@@ -10,17 +11,30 @@ struct workq_entry {
 	struct workq_entry *next;
 };
 
+struct workq_list {
+	struct workq_entry *head, *tail;
+};
+
+static _Thread_local int self = -1;
+static _Thread_local int node = -1;
+
 struct wq {
 	struct {
 		pthread_mutex_t mutex;
 		pthread_cond_t work_available, queue_empty;
 	} locks;
 	struct {
-		unsigned active, target, waiting;
+		unsigned active, target, waiting, started;
 		int destroy;
 	} workers;
 	unsigned waiting;
-	struct workq_entry *entries;
+	/*
+	 * Work for any worker, and with topology, work for the workers
+	 * of each of its nodes. queued counts the entries in all of them.
+	 */
+	struct workq_list any, *nodes;
+	unsigned queued;
+	const struct topology *topology;
 	struct {
 		unsigned length;
 		pthread_t *items;
@@ -28,20 +42,54 @@ struct wq {
 };
 
 
+static struct workq_entry* pop(struct workq_list *list)
+{
+	struct workq_entry *entry = list->head;
+	if (entry) {
+		list->head = entry->next;
+		if (!list->head)
+			list->tail = NULL;
+	}
+	return entry;
+}
+
+/*
+ * Takes the oldest work for the node of the calling worker, or else
+ * for any worker, or else for another node rather than idling.
+ */
+static struct workq_entry* take(struct wq *q)
+{
+	struct workq_entry *entry = NULL;
+	if (node >= 0)
+		entry = pop(q->nodes + node);
+	if (!entry)
+		entry = pop(&q->any);
+	for(unsigned i = 0; !entry && q->topology && i < q->topology->nodes; ++i)
+		entry = pop(q->nodes + i);
+
+	q->queued--;
+	return entry;
+}
+
 static void* worker(void *_a)
 {
 	struct wq *q = _a;
 
 	pthread_mutex_lock(&q->locks.mutex);
+	self = q->workers.started++;
+	if (q->topology) {
+		// Spread over the nodes, so that each gets its share of workers.
+		node = self % q->topology->nodes;
+		topology_pin(q->topology, node);
+	}
 	for (;;) {
 		if (q->workers.destroy)
 			break;
 
 		int reached_target = q->workers.active >= q->workers.target;
-		int work_available = !!q->entries;
+		int work_available = q->queued > 0;
 		if (work_available && !reached_target) {
-			struct workq_entry *entry = q->entries;
-			q->entries = entry->next;
+			struct workq_entry *entry = take(q);
 
 			q->workers.active++;
 			pthread_mutex_unlock(&q->locks.mutex);
@@ -56,7 +104,7 @@ static void* worker(void *_a)
 				break;
 
 			int workers_active = q->workers.active > 0;
-			work_available = !!q->entries;
+			work_available = q->queued > 0;
 			if (!work_available && !workers_active)
 				pthread_cond_signal(&q->locks.queue_empty);
 		} else {
@@ -77,14 +125,10 @@ static void* worker(void *_a)
 	if (q->workers.active == 0 && q->workers.waiting == 0) {
 		pthread_cond_destroy(&q->locks.work_available);
 
-		struct workq_entry *entry = q->entries;
-		q->entries = NULL;
-		while(entry) {
+		while(q->queued) {
+			struct workq_entry *entry = take(q);
 			entry->work(entry->data, 0);
-
-			void *e = entry;
-			entry = entry->next;
-			free(e);
+			free(entry);
 		}
 
 		pthread_cond_signal(&q->locks.queue_empty);
@@ -99,7 +143,7 @@ static void* worker(void *_a)
 
 static void internal_stop(struct wq *q)
 {
-	int has_work = !!q->entries;
+	int has_work = q->queued > 0;
 	int has_workers = q->workers.active;
 	if (q->workers.destroy || has_work || has_workers) {
 		q->waiting++;
@@ -116,6 +160,7 @@ static void internal_stop(struct wq *q)
 			pthread_join(q->threads.items[i], NULL);
 		if (q->threads.items)
 			free(q->threads.items);
+		free(q->nodes);
 
 		pthread_cond_destroy(&q->locks.queue_empty);
 		pthread_mutex_destroy(&q->locks.mutex);
@@ -154,9 +199,14 @@ int workq_create(struct workq *queue)
 	q->workers.active = 0;
 	q->workers.target = 0;
 	q->workers.waiting = 0;
+	q->workers.started = 0;
 	q->workers.destroy = 0;
 	q->waiting = 0;
-	q->entries = NULL;
+	q->any.head = NULL;
+	q->any.tail = NULL;
+	q->nodes = NULL;
+	q->queued = 0;
+	q->topology = NULL;
 	q->threads.length = 0;
 	q->threads.items = NULL;
 
@@ -227,6 +277,33 @@ exit:
 }
 
 
+int workq_pin(struct workq *queue, const struct topology *topology)
+{
+	if (!queue) return 0;
+	if (!queue->opaque) return 0;
+
+	struct wq *q = queue->opaque;
+
+	pthread_mutex_lock(&q->locks.mutex);
+	if (q->threads.length > 0 || q->topology || !topology->nodes)
+		goto exit;
+
+	q->nodes = malloc(sizeof(struct workq_list) * topology->nodes);
+	if (!q->nodes)
+		goto exit;
+	for(unsigned i = 0; i < topology->nodes; ++i) {
+		q->nodes[i].head = NULL;
+		q->nodes[i].tail = NULL;
+	}
+	q->topology = topology;
+
+	pthread_mutex_unlock(&q->locks.mutex);
+	return 1;
+exit:
+	pthread_mutex_unlock(&q->locks.mutex);
+	return 0;
+}
+
 void workq_stop(struct workq *queue)
 {
 	if (!queue) return;
@@ -250,27 +327,62 @@ void workq_wait(struct workq *queue)
 	internal_stop(q);
 }
 
+unsigned workq_workers(struct workq *queue)
+{
+	if (!queue) return 0;
+	if (!queue->opaque) return 0;
+
+	struct wq *q = queue->opaque;
+
+	pthread_mutex_lock(&q->locks.mutex);
+	unsigned workers = q->threads.length;
+	pthread_mutex_unlock(&q->locks.mutex);
+
+	return workers;
+}
+
+int workq_self()
+{
+	return self;
+}
+
 int workq_add(struct workq *queue,
               void *data,
               void (*work)(void*, int))
+{
+	return workq_add_on(queue, -1, data, work);
+}
+
+int workq_add_on(struct workq *queue,
+                 int node,
+                 void *data,
+                 void (*work)(void*, int))
 {
 	if (!queue) return 0;
 	if (!queue->opaque) return 0;
 
+	struct workq_entry *entry = malloc(sizeof(struct workq_entry));
+	if (!entry)
+		return 0;
+	entry->data = data;
+	entry->work = work;
+	entry->next = NULL;
+
 	struct wq *q = queue->opaque;
 	pthread_mutex_lock(&q->locks.mutex);
 
-	struct workq_entry **entry = &q->entries;
-	while(*entry) {
-		entry = &(*entry)->next;
-	}
-	*entry = malloc(sizeof(struct workq_entry));
-	if (!*entry)
-		return 0;
-	(*entry)->data = data;
-	(*entry)->work = work;
-	(*entry)->next = NULL;
+	struct workq_list *list = &q->any;
+	if (q->topology && node >= 0 && (unsigned)node < q->topology->nodes)
+		list = q->nodes + node;
+
+	if (list->tail)
+		list->tail->next = entry;
+	else
+		list->head = entry;
+	list->tail = entry;
+	q->queued++;
 
+	// Workers of other nodes take it too, rather than idle.
 	pthread_cond_signal(&q->locks.work_available);
 
 	pthread_mutex_unlock(&q->locks.mutex);
@@ -1,3 +1,5 @@
+struct topology;
+
 struct workq {
 	void *opaque; // That's all you get!
 };
@@ -30,6 +32,25 @@ void workq_destroy(struct workq *queue);
 int workq_add(struct workq *queue,
               void *data,
               void (*work)(void*, int));
+/*
+ * Adds an operation as workq_add, preferably run by a worker on
+ * node of the topology given to workq_pin. Workers of other nodes
+ * only run it when they have nothing else to do. A negative node,
+ * or a queue not pinned, runs it on any worker.
+ */
+int workq_add_on(struct workq *queue,
+                 int node,
+                 void *data,
+                 void (*work)(void*, int));
+
+/*
+ * Pins the workers to be started to the nodes of topology, which
+ * must outlive the queue, taking turns over the nodes. Must be
+ * called before workq_start.
+ *
+ * Returns non-zero on success.
+ */
+int workq_pin(struct workq *queue, const struct topology *topology);
 
 /*
  * Starts the workq using with the provided number of
@@ -49,3 +70,13 @@ void workq_stop(struct workq *queue);
  * Waits ofr all queued operations to finish.
  */
 void workq_wait(struct workq *queue);
+
+/*
+ * Returns the number of worker threads started.
+ */
+unsigned workq_workers(struct workq *queue);
+/*
+ * Returns the index of the calling worker thread, from zero up to
+ * the number of workers started, or -1 when not called from a worker.
+ */
+int workq_self();